@@ -29,6 +29,28 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/syscalls.h>
+#include <linux/sched.h>
+#include <linux/sched/task.h>
+#include <linux/pid.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+#include <linux/hashtable.h>
+#include <linux/llist.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/tracepoint.h>
+#include <linux/pid_namespace.h>
+#include <linux/sched/signal.h>
+#include <linux/overflow.h>
+#include <linux/seqlock.h>
+#include <linux/binfmts.h>
 
 #define AUTHOR "Fernando Vanyo <fernando@fervagar.com>"
 #define DESC   "Module that show the generation of a process"
@@ -37,36 +59,1116 @@ MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR(AUTHOR);
 MODULE_DESCRIPTION(DESC);
 
+#define QUERY_MAX_WRITE		(1 << 20)	// bytes of pids accepted per write()
+#define QUERY_LINE_LEN		24		// "<pid> <generation>\n"
+#define DEPTH_CACHE_BITS	16
+#define ANC_LEVELS		16		// jump tables cover ranks below 2^16
+#define ANC_MAX_RANK		((1U << ANC_LEVELS) - 1)
+#define ANC_INVALID		UINT_MAX	// no table, queries use the walk
+
 int pid = 0;
 module_param(pid, int, S_IRUGO);
 
-asmlinkage unsigned long generation(int argpid);
+static bool verify = false;
+module_param(verify, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(verify, "Check every cached generation against a walk of the parent chain");
+
+static struct dentry *debugfs_dir;
+
+asmlinkage long generation(int argpid);
+asmlinkage long ancestor(int argpid, unsigned int k);
+asmlinkage long is_descendant(int argpid, int ancpid);
+asmlinkage long lowest_common_ancestor(int apid, int bpid);
 
 EXPORT_SYMBOL(generation);
+EXPORT_SYMBOL(ancestor);
+EXPORT_SYMBOL(is_descendant);
+EXPORT_SYMBOL(lowest_common_ancestor);
+
+/**
+ *  Generation of a task by walking up its real_parent chain, O(depth).
+ *  Called under rcu_read_lock()
+ */
+static long generation_walk(struct task_struct *p){
+	long generation = 1;
+
+	// Up to init; the idle task (parent of kthreadd) is its own parent
+	for (; p->pid != 1; generation++){
+		struct task_struct *parent = rcu_dereference(p->real_parent);
+
+		if (parent == p)
+			break;
+		p = parent;
+	}
+
+	return generation;
+}
+
+// -- Depth cache, kept up to date from the fork and exit tracepoints -- //
+
+/**
+ *  One entry per task, hashed by global pid. The task pointer is only used as
+ *  an identity check against pid reuse, it is never dereferenced.
+ *  Readers use RCU, writers take cache_lock.
+ */
+struct depth_entry {
+	struct hlist_node node;
+	struct task_struct *task;
+	pid_t pid;
+	pid_t tgid;
+	long depth;
+	seqcount_t seq;			// protects rank and up[] for lockless readers
+	unsigned int rank;		// ancestors in the index, or ANC_INVALID
+	pid_t up[ANC_LEVELS];		// see index_build()
+	struct rcu_head rcu;
+};
+
+/**
+ *  A child of an exiting task. exit_notify() reparents it (to another thread of
+ *  the group, a subreaper or init) after the exit tracepoint, so the subtree is
+ *  fixed up later from reparent_work.
+ */
+struct orphan {
+	struct llist_node node;
+	pid_t pid;
+	struct task_struct *old_parent;	// identity only
+};
+
+static DEFINE_HASHTABLE(depth_cache, DEPTH_CACHE_BITS);
+static DEFINE_SPINLOCK(cache_lock);
+static struct kmem_cache *entry_cachep;
+
+static LLIST_HEAD(orphans);
+static void reparent_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(reparent_work, reparent_fn);
+
+static struct tracepoint *tp_fork, *tp_exit, *tp_exec;
+
+static atomic64_t cache_hits, cache_misses, cache_mismatches;
+
+// Called under rcu_read_lock() or cache_lock
+static struct depth_entry *cache_find(struct task_struct *t){
+	struct depth_entry *e;
+
+	hash_for_each_possible_rcu(depth_cache, e, node, t->pid)
+		if (e->task == t && e->pid == t->pid)
+			return e;
+
+	return NULL;
+}
+
+static void index_build(struct depth_entry *e, struct task_struct *t);
+
+// Called under rcu_read_lock()
+static void cache_set(struct task_struct *t, long depth){
+	struct depth_entry *e;
+
+	spin_lock(&cache_lock);
+	e = cache_find(t);
+	if (e != NULL){
+		WRITE_ONCE(e->depth, depth);
+		write_seqcount_begin(&e->seq);
+		index_build(e, t);
+		write_seqcount_end(&e->seq);
+		goto out;
+	}
+
+	// An exiting task has already been (or is about to be) removed by probe_exit()
+	if (t->flags & PF_EXITING)
+		goto out;
+
+	// On failure queries for this task fall back to the walk
+	e = kmem_cache_alloc(entry_cachep, GFP_ATOMIC);
+	if (e != NULL){
+		e->task = t;
+		e->pid = t->pid;
+		e->tgid = t->tgid;
+		e->depth = depth;
+		seqcount_init(&e->seq);
+		index_build(e, t);
+		hash_add_rcu(depth_cache, &e->node, e->pid);
+	}
+out:
+	spin_unlock(&cache_lock);
+}
+
+static void entry_free_rcu(struct rcu_head *rcu){
+	kmem_cache_free(entry_cachep, container_of(rcu, struct depth_entry, rcu));
+}
+
+// Called with cache_lock held
+static void entry_drop(struct depth_entry *e){
+	hash_del_rcu(&e->node);
+	call_rcu(&e->rcu, entry_free_rcu);
+}
+
+static void cache_del(struct task_struct *t){
+	struct depth_entry *e;
+
+	spin_lock(&cache_lock);
+	e = cache_find(t);
+	if (e != NULL)
+		entry_drop(e);
+	spin_unlock(&cache_lock);
+}
+
+// Called under rcu_read_lock()
+static long generation_task(struct task_struct *t){
+	struct depth_entry *e = cache_find(t);
+	long depth, walked;
+
+	if (e == NULL){
+		atomic64_inc(&cache_misses);
+		return generation_walk(t);
+	}
+	atomic64_inc(&cache_hits);
+	depth = READ_ONCE(e->depth);
+
+	if (READ_ONCE(verify)){
+		walked = generation_walk(t);
+		if (walked != depth){
+			atomic64_inc(&cache_mismatches);
+			pr_warn_ratelimited("generation: stale depth for pid %d: cached %ld, walked %ld\n",
+					    t->pid, depth, walked);
+			return walked;
+		}
+	}
+
+	return depth;
+}
+
+/**
+ *  Depth of a task from the (usually cached) depth of its real_parent, not
+ *  parent: that one is the tracer. Called under rcu_read_lock()
+ */
+static long generation_from_parent(struct task_struct *t){
+	if (t->pid == 1)
+		return 1;
+
+	return generation_task(rcu_dereference(t->real_parent)) + 1;
+}
+
+static void probe_fork(void *data, struct task_struct *parent, struct task_struct *child){
+	rcu_read_lock();
+	// CLONE_PARENT and CLONE_THREAD children are siblings of 'parent'
+	cache_set(child, generation_from_parent(child));
+	rcu_read_unlock();
+}
+
+static void probe_exit(void *data, struct task_struct *p){
+	struct task_struct *child;
+	struct orphan *o;
+	bool queued = false;
+	bool group_dead = atomic_read(&p->signal->live) == 0;
+
+	// A zombie leader stays in the index while the rest of its group runs
+	if (!thread_group_leader(p) || group_dead)
+		cache_del(p);
+	if (group_dead && !thread_group_leader(p))
+		cache_del(p->group_leader);
+
+	if (list_empty(&p->children))
+		return;
+
+	read_lock(&tasklist_lock);
+	list_for_each_entry(child, &p->children, sibling){
+		o = kmalloc(sizeof(*o), GFP_ATOMIC);
+		if (o == NULL)
+			continue;	// verify mode will report the stale subtree
+		o->pid = child->pid;
+		o->old_parent = p;
+		llist_add(&o->node, &orphans);
+		queued = true;
+	}
+	read_unlock(&tasklist_lock);
+
+	if (queued)
+		mod_delayed_work(system_wq, &reparent_work, 1);
+}
+
+// Next thread of th's group, NULL after the last one. Called with tasklist_lock held
+static struct task_struct *thread_after(struct task_struct *th){
+	if (list_is_last(&th->thread_node, &th->signal->thread_head))
+		return NULL;
+
+	return list_next_entry(th, thread_node);
+}
+
+/**
+ *  First child of th or of the threads after it in its group. A process forked
+ *  from a thread other than the leader is on that thread's children list.
+ *  Called with tasklist_lock held
+ */
+static struct task_struct *first_child_from(struct task_struct *th){
+	for (; th != NULL; th = thread_after(th))
+		if (!list_empty(&th->children))
+			return list_first_entry(&th->children, struct task_struct, sibling);
+
+	return NULL;
+}
+
+/**
+ *  An exec from a thread other than the leader: de_thread() has released the
+ *  old leader (whose exit left its entry in, the group was still alive) and
+ *  given the leader's pid to p, with no exit event for either id. Drop both
+ *  entries and cache p again under its new pid.
+ */
+static void probe_exec(void *data, struct task_struct *p, pid_t old_pid,
+		       struct linux_binprm *bprm){
+	struct depth_entry *e;
+	struct hlist_node *tmp;
+
+	if (old_pid == p->pid)
+		return;
+
+	spin_lock(&cache_lock);
+	hash_for_each_possible_safe(depth_cache, e, tmp, node, old_pid)
+		if (e->task == p && e->pid == old_pid)
+			entry_drop(e);
+	hash_for_each_possible_safe(depth_cache, e, tmp, node, p->pid)
+		if (e->pid == p->pid && e->task != p)
+			entry_drop(e);
+	spin_unlock(&cache_lock);
+
+	rcu_read_lock();
+	cache_set(p, generation_from_parent(p));
+	rcu_read_unlock();
+}
+
+/**
+ *  Next process after t in a pre-order walk of root's subtree, NULL at the end.
+ *  The children of a process are those on the children lists of all its
+ *  threads. Goes through them and the sibling lists using real_parent to climb
+ *  back, so it needs no stack. *depth follows the depth. root and t are thread
+ *  group leaders. Called with tasklist_lock held for reading
+ */
+static struct task_struct *next_preorder(struct task_struct *root, struct task_struct *t,
+					 long *depth){
+	struct task_struct *child, *parent;
+
+	child = first_child_from(t);
+	if (child != NULL){
+		(*depth)++;
+		return child;
+	}
+
+	while (t != root){
+		parent = t->real_parent;
+		if (!list_is_last(&t->sibling, &parent->children))
+			return list_next_entry(t, sibling);
+
+		// The children of the next threads of the parent process
+		child = first_child_from(thread_after(parent));
+		if (child != NULL)
+			return child;
+
+		t = parent->group_leader;
+		(*depth)--;
+	}
+
+	return NULL;
+}
+
+/**
+ *  Recompute the depth of every task below root, root included, top-down.
+ *  Called with tasklist_lock held for reading and under rcu_read_lock()
+ */
+static void fix_subtree(struct task_struct *root){
+	struct task_struct *t, *th;
+	long depth = generation_from_parent(root);
+	struct depth_entry *e = cache_find(root);
+
+	// Reparented to a task at the same depth (e.g. another thread of the group)
+	if (e != NULL && READ_ONCE(e->depth) == depth)
+		return;
+
+	for (t = root; t != NULL; t = next_preorder(root, t, &depth)){
+		// Threads other than the leader are not on the children lists
+		for_each_thread(t, th)
+			cache_set(th, depth);
+	}
+}
+
+static void reparent_fn(struct work_struct *work){
+	struct llist_node *list = llist_del_all(&orphans);
+	struct task_struct *t;
+	struct orphan *o, *next;
+	bool retry = false;
+
+	rcu_read_lock();
+	read_lock(&tasklist_lock);
+	llist_for_each_entry_safe(o, next, list, node){
+		t = pid_task(find_pid_ns(o->pid, &init_pid_ns), PIDTYPE_PID);
+		if (t != NULL && t->real_parent == o->old_parent){
+			// exit_notify() has not run yet, try again later
+			llist_add(&o->node, &orphans);
+			retry = true;
+			continue;
+		}
+		if (t != NULL)
+			fix_subtree(t);
+		kfree(o);
+	}
+	read_unlock(&tasklist_lock);
+	rcu_read_unlock();
+
+	if (retry)
+		mod_delayed_work(system_wq, &reparent_work, 1);
+}
+
+static void find_tracepoints(struct tracepoint *tp, void *priv){
+	if (!strcmp(tp->name, "sched_process_fork"))
+		tp_fork = tp;
+	else if (!strcmp(tp->name, "sched_process_exit"))
+		tp_exit = tp;
+	else if (!strcmp(tp->name, "sched_process_exec"))
+		tp_exec = tp;
+}
+
+// Frees everything once the probes are gone
+static void cache_destroy(void){
+	struct depth_entry *e;
+	struct hlist_node *tmp;
+	struct orphan *o, *next;
+	int bkt;
+
+	cancel_delayed_work_sync(&reparent_work);
+	llist_for_each_entry_safe(o, next, llist_del_all(&orphans), node)
+		kfree(o);
+
+	spin_lock(&cache_lock);
+	hash_for_each_safe(depth_cache, bkt, tmp, e, node)
+		entry_drop(e);
+	spin_unlock(&cache_lock);
+
+	rcu_barrier();
+	kmem_cache_destroy(entry_cachep);
+}
+
+static int cache_init(void){
+	struct task_struct *t, *th;
+	long depth = 0;
+	int ret;
+
+	entry_cachep = KMEM_CACHE(depth_entry, 0);
+	if (entry_cachep == NULL)
+		return -ENOMEM;
+
+	for_each_kernel_tracepoint(find_tracepoints, NULL);
+	if (tp_fork == NULL || tp_exit == NULL || tp_exec == NULL){
+		printk(KERN_ERR "generation: sched_process_{fork,exit,exec} tracepoints not found\n");
+		ret = -ENOENT;
+		goto err_cache;
+	}
+
+	// Hook first, so no task created during the initial scan is missed
+	ret = tracepoint_probe_register(tp_fork, probe_fork, NULL);
+	if (ret)
+		goto err_cache;
+	ret = tracepoint_probe_register(tp_exit, probe_exit, NULL);
+	if (ret)
+		goto err_fork;
+	ret = tracepoint_probe_register(tp_exec, probe_exec, NULL);
+	if (ret)
+		goto err_exit;
+
+	/*
+	 * Pre-order, so every parent is cached (and indexed) before its children.
+	 * It includes processes forked from non-leader threads. A process missed
+	 * here would leave its whole subtree with ANC_INVALID tables.
+	 */
+	rcu_read_lock();
+	read_lock(&tasklist_lock);
+	for (t = next_preorder(&init_task, &init_task, &depth); t != NULL;
+	     t = next_preorder(&init_task, t, &depth)){
+		for_each_thread(t, th)
+			cache_set(th, generation_from_parent(th));
+	}
+	read_unlock(&tasklist_lock);
+	rcu_read_unlock();
+
+	return 0;
+
+err_exit:
+	tracepoint_probe_unregister(tp_exit, probe_exit, NULL);
+err_fork:
+	tracepoint_probe_unregister(tp_fork, probe_fork, NULL);
+	tracepoint_synchronize_unregister();
+	// The probes may have cached tasks and queued orphans already
+	cache_destroy();
+	return ret;
+err_cache:
+	kmem_cache_destroy(entry_cachep);
+	return ret;
+}
+
+static void cache_exit(void){
+	tracepoint_probe_unregister(tp_exec, probe_exec, NULL);
+	tracepoint_probe_unregister(tp_exit, probe_exit, NULL);
+	tracepoint_probe_unregister(tp_fork, probe_fork, NULL);
+	tracepoint_synchronize_unregister();
+
+	cache_destroy();
+}
+
+// -- Ancestry index: is-descendant, k-th ancestor and LCA in O(log depth) -- //
+
+/**
+ *  Binary lifting over processes (thread group leaders): up[k] of an entry is
+ *  the tgid of its 2^k-th ancestor process, 0 past the root of its tree (init
+ *  or kthreadd). The tables are built from the parent's one when a task is
+ *  cached and rebuilt top-down by fix_subtree() after a reparent. Whenever the
+ *  index cannot answer (missing or invalid entry) the parent walk does.
+ */
+struct anc_view {
+	unsigned int rank;
+	pid_t up[ANC_LEVELS];
+};
+
+static atomic64_t index_fallbacks, index_mismatches;
+
+// Called under rcu_read_lock() or cache_lock
+static struct depth_entry *cache_find_process(pid_t tgid){
+	struct depth_entry *e;
+
+	hash_for_each_possible_rcu(depth_cache, e, node, tgid)
+		if (e->pid == tgid && e->tgid == tgid)
+			return e;
+
+	return NULL;
+}
+
+// Called with cache_lock held and under rcu_read_lock(), e->seq write side open
+static void index_build(struct depth_entry *e, struct task_struct *t){
+	struct task_struct *parent = rcu_dereference(t->real_parent);
+	struct depth_entry *a;
+	int k;
+
+	memset(e->up, 0, sizeof(e->up));
+	e->rank = 0;
+
+	// Children of the idle task are the roots
+	if (t->pid == 1 || parent->pid == 0)
+		return;
+
+	a = cache_find_process(parent->tgid);
+	if (a == NULL || a->rank >= ANC_MAX_RANK){
+		e->rank = ANC_INVALID;
+		return;
+	}
+	e->rank = a->rank + 1;
+	e->up[0] = parent->tgid;
+
+	// The 2^k-th ancestor is the 2^(k-1)-th ancestor of the 2^(k-1)-th ancestor
+	for (k = 1; k < ANC_LEVELS; k++){
+		a = cache_find_process(e->up[k - 1]);
+		if (a == NULL || a->rank == ANC_INVALID){
+			e->rank = ANC_INVALID;
+			return;
+		}
+		e->up[k] = a->up[k - 1];
+		if (e->up[k] == 0)
+			break;
+	}
+}
+
+// Called under rcu_read_lock(). False if the index has nothing valid for tgid
+static bool index_view(pid_t tgid, struct anc_view *v){
+	struct depth_entry *e = cache_find_process(tgid);
+	unsigned int seq;
+
+	if (e == NULL)
+		return false;
+
+	do {
+		seq = read_seqcount_begin(&e->seq);
+		v->rank = e->rank;
+		memcpy(v->up, e->up, sizeof(v->up));
+	} while (read_seqcount_retry(&e->seq, seq));
+
+	return v->rank <= ANC_MAX_RANK;
+}
+
+// k-th ancestor of a process, 0 if it has fewer ancestors, -EAGAIN: use the walk
+static long index_ancestor(pid_t tgid, unsigned int k){
+	struct anc_view v;
+	int i;
+
+	if (!index_view(tgid, &v))
+		return -EAGAIN;
+	if (k > v.rank)
+		return 0;
+
+	for (i = 0; k; i++, k >>= 1){
+		if (!(k & 1))
+			continue;
+		if (!index_view(tgid, &v))
+			return -EAGAIN;
+		tgid = v.up[i];
+	}
+	return tgid;
+}
+
+static long index_lca(pid_t a, pid_t b){
+	struct anc_view va, vb;
+	long ret;
+	int i;
+
+	if (!index_view(a, &va) || !index_view(b, &vb))
+		return -EAGAIN;
+
+	// Bring both to the same rank
+	ret = index_ancestor(va.rank > vb.rank ? a : b, abs((int) va.rank - (int) vb.rank));
+	if (ret < 0)
+		return ret;
+	if (va.rank > vb.rank)
+		a = ret;
+	else
+		b = ret;
+
+	if (a == b)
+		return a;
+
+	// Climb as far as the ancestors differ; the parent of that point is the LCA
+	for (i = ANC_LEVELS - 1; i >= 0; i--){
+		if (!index_view(a, &va) || !index_view(b, &vb))
+			return -EAGAIN;
+		if (va.up[i] != vb.up[i]){
+			a = va.up[i];
+			b = vb.up[i];
+		}
+	}
+	if (!index_view(a, &va))
+		return -EAGAIN;
+
+	return va.up[0];	// 0: a and b are in different trees
+}
+
+// -- The same queries by walking the real_parent chains, O(depth) -- //
+
+// Called under rcu_read_lock()
+static struct task_struct *walk_parent(struct task_struct *p){
+	struct task_struct *parent = rcu_dereference(p->real_parent);
+
+	if (p->pid == 1 || parent->pid == 0)
+		return NULL;
+
+	return parent->group_leader;
+}
 
-asmlinkage unsigned long generation(int argpid){
-	int generation = 1;
+static struct task_struct *process_of(pid_t tgid){
+	return pid_task(find_pid_ns(tgid, &init_pid_ns), PIDTYPE_PID);
+}
+
+static long walk_rank(pid_t tgid){
+	struct task_struct *p = process_of(tgid);
+	long rank = 0;
+
+	if (p == NULL)
+		return -ESRCH;
+
+	while ((p = walk_parent(p)) != NULL)
+		rank++;
+
+	return rank;
+}
+
+static long walk_ancestor(pid_t tgid, unsigned int k){
+	struct task_struct *p = process_of(tgid);
+
+	if (p == NULL)
+		return -ESRCH;
+
+	while (k-- && p != NULL)
+		p = walk_parent(p);
+
+	return p ? p->tgid : 0;
+}
+
+static long walk_lca(pid_t a, pid_t b){
+	struct task_struct *p = process_of(a), *q = process_of(b);
+	long ra = walk_rank(a), rb = walk_rank(b);
+
+	if (p == NULL || q == NULL)
+		return -ESRCH;
+
+	for (; ra > rb; ra--)
+		p = walk_parent(p);
+	for (; rb > ra; rb--)
+		q = walk_parent(q);
+
+	while (p != NULL && q != NULL && p != q){
+		p = walk_parent(p);
+		q = walk_parent(q);
+	}
+
+	return (p != NULL && p == q) ? p->tgid : 0;
+}
+
+// Index answer, the walk when the index cannot answer or when verifying it
+static long anc_checked(long indexed, long walked){
+	if (indexed == -EAGAIN){
+		atomic64_inc(&index_fallbacks);
+		return walked;
+	}
+	if (indexed != walked){
+		atomic64_inc(&index_mismatches);
+		pr_warn_ratelimited("generation: stale ancestry index: %ld, walked %ld\n",
+				    indexed, walked);
+		return walked;
+	}
+	return indexed;
+}
+
+static long anc_rank(pid_t tgid){
+	struct anc_view v;
+	long ret = index_view(tgid, &v) ? (long) v.rank : -EAGAIN;
+
+	if (ret == -EAGAIN || READ_ONCE(verify))
+		ret = anc_checked(ret, walk_rank(tgid));
+	return ret;
+}
+
+static long anc_ancestor(pid_t tgid, unsigned int k){
+	long ret = index_ancestor(tgid, k);
+
+	if (ret == -EAGAIN || READ_ONCE(verify))
+		ret = anc_checked(ret, walk_ancestor(tgid, k));
+	return ret;
+}
+
+static long anc_lca(pid_t a, pid_t b){
+	long ret = index_lca(a, b);
+
+	if (ret == -EAGAIN || READ_ONCE(verify))
+		ret = anc_checked(ret, walk_lca(a, b));
+	return ret;
+}
+
+// Global tgid of a pid of the caller's namespace, 0 if there is no such task
+static pid_t global_tgid(int argpid){
+	struct task_struct *t = pid_task(find_vpid(argpid), PIDTYPE_PID);
+
+	return t ? t->tgid : 0;
+}
+
+// Back to the caller's namespace: -ENOENT if tgid is 0 or not visible from it
+static long caller_pid(long tgid){
+	pid_t nr;
+
+	if (tgid <= 0)
+		return tgid ? tgid : -ENOENT;
+
+	nr = pid_vnr(find_pid_ns(tgid, &init_pid_ns));
+	return nr ? nr : -ENOENT;
+}
+
+/**
+ *  k-th ancestor process of argpid (k = 1: its parent process).
+ *  Returns its pid, -ENOENT if argpid has fewer than k ancestors, or -ESRCH.
+ */
+asmlinkage long ancestor(int argpid, unsigned int k){
+	pid_t tgid;
+	long ret;
+
+	rcu_read_lock();
+	tgid = global_tgid(argpid);
+	ret = tgid ? caller_pid(anc_ancestor(tgid, k)) : -ESRCH;
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/**
+ *  1 if the process of argpid is the process of ancpid or one of its
+ *  descendants, 0 if it is not, -ESRCH if any of the pids does not exist.
+ */
+asmlinkage long is_descendant(int argpid, int ancpid){
+	pid_t a, b;
+	long ra, rb, ret;
+
+	rcu_read_lock();
+	a = global_tgid(argpid);
+	b = global_tgid(ancpid);
+	if (!a || !b){
+		ret = -ESRCH;
+		goto out;
+	}
+
+	ra = anc_rank(a);
+	rb = anc_rank(b);
+	if (ra < 0 || rb < 0){
+		ret = -ESRCH;
+		goto out;
+	}
+
+	ret = (ra >= rb && anc_ancestor(a, ra - rb) == b);
+out:
+	rcu_read_unlock();
+	return ret;
+}
+
+/**
+ *  Lowest common ancestor process of two pids (one of them if it is an
+ *  ancestor of the other). -ENOENT if they are in different trees (init and
+ *  kthreadd), -ESRCH if any of the pids does not exist.
+ */
+asmlinkage long lowest_common_ancestor(int apid, int bpid){
+	pid_t a, b;
+	long ret;
+
+	rcu_read_lock();
+	a = global_tgid(apid);
+	b = global_tgid(bpid);
+	ret = (a && b) ? caller_pid(anc_lca(a, b)) : -ESRCH;
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static int cache_stats_show(struct seq_file *m, void *v){
+	seq_printf(m, "hits: %lld\nmisses: %lld\nmismatches: %lld\n",
+		   atomic64_read(&cache_hits), atomic64_read(&cache_misses),
+		   atomic64_read(&cache_mismatches));
+	seq_printf(m, "index fallbacks: %lld\nindex mismatches: %lld\n",
+		   atomic64_read(&index_fallbacks), atomic64_read(&index_mismatches));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(cache_stats);
+
+// Called under rcu_read_lock()
+static long generation_rcu(int argpid){
+	struct task_struct *p;
+
+	p = pid_task(find_vpid(argpid), PIDTYPE_PID);
+	if (p == NULL)
+		return -ESRCH;
+
+	return generation_task(p);
+}
+
+/**
+ *  Generation of a process: 1 for init, 2 for its children and so on.
+ *  O(1) from the depth cache; with verify=1 it is checked against the walk.
+ *  Returns -ESRCH if there is no such pid in the caller's pid namespace.
+ */
+asmlinkage long generation(int argpid){
+	long ret;
+
+	rcu_read_lock();
+	ret = generation_rcu(argpid);
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/**
+ *  Batch queries: /sys/kernel/debug/generation/query
+ *  Write a list of pids separated by spaces, commas or newlines, then read back
+ *  one "<pid> <generation>" line per pid (a negative errno for unknown pids).
+ *  Each open file keeps the answer to its last write.
+ */
+struct query_buf {
+	struct mutex lock;
+	char *out;
+	size_t len;
+};
+
+static int query_open(struct inode *inode, struct file *f){
+	struct query_buf *q = kzalloc(sizeof(*q), GFP_KERNEL);
+
+	if (q == NULL)
+		return -ENOMEM;
+
+	mutex_init(&q->lock);
+	f->private_data = q;
+	return 0;
+}
+
+static int query_release(struct inode *inode, struct file *f){
+	struct query_buf *q = f->private_data;
+
+	kvfree(q->out);
+	kfree(q);
+	return 0;
+}
+
+static ssize_t query_write(struct file *f, const char __user *buf, size_t len, loff_t *off){
+	struct query_buf *q = f->private_data;
+	char *in, *cur, *tok, *out;
+	size_t max_out, pos = 0;
+	unsigned int n = 0;
+	int argpid;
+
+	if (len == 0 || len > QUERY_MAX_WRITE)
+		return -EINVAL;
+
+	in = memdup_user_nul(buf, len);
+	if (IS_ERR(in))
+		return PTR_ERR(in);
+
+	// A pid takes at least two input bytes (digit + separator)
+	max_out = (len / 2 + 1) * QUERY_LINE_LEN;
+	out = kvmalloc(max_out, GFP_KERNEL);
+	if (out == NULL){
+		kfree(in);
+		return -ENOMEM;
+	}
+
+	// A single RCU section for the batch (no lock per pid)
+	rcu_read_lock();
+	cur = in;
+	while ((tok = strsep(&cur, " ,\t\n")) != NULL){
+		if (*tok == '\0')
+			continue;
+		if (kstrtoint(tok, 10, &argpid) < 0 || argpid <= 0){
+			rcu_read_unlock();
+			kvfree(out);
+			kfree(in);
+			return -EINVAL;
+		}
+		pos += scnprintf(out + pos, max_out - pos, "%d %ld\n",
+				 argpid, generation_rcu(argpid));
+		// Don't hold the RCU read side for the whole of a huge batch
+		if (++n % 256 == 0)
+			cond_resched_rcu();
+	}
+	rcu_read_unlock();
+	kfree(in);
+
+	mutex_lock(&q->lock);
+	kvfree(q->out);
+	q->out = out;
+	q->len = pos;
+	mutex_unlock(&q->lock);
+
+	// Reads start from the new answer
+	*off = 0;
+	return len;
+}
+
+static ssize_t query_read(struct file *f, char __user *buf, size_t len, loff_t *off){
+	struct query_buf *q = f->private_data;
+	ssize_t ret;
+
+	mutex_lock(&q->lock);
+	ret = simple_read_from_buffer(buf, len, off, q->out, q->len);
+	mutex_unlock(&q->lock);
+
+	return ret;
+}
+
+static const struct file_operations query_fops = {
+	.owner = THIS_MODULE,
+	.open = query_open,
+	.release = query_release,
+	.read = query_read,
+	.write = query_write,
+	.llseek = default_llseek,
+};
+
+/**
+ *  Whole tree export: /sys/kernel/debug/generation/tree
+ *  One "<pid> <ppid> <generation> <subtree size>" line per process (thread group
+ *  leader; ppid is the parent process, whichever of its threads forked it;
+ *  subtree size counts processes, itself included). The tree is copied
+ *  at open() in a single pre-order walk, so the output stays consistent however
+ *  many read() calls it takes.
+ */
+struct tree_entry {
+	pid_t pid;
+	pid_t ppid;
+	unsigned int depth;	// below the idle task
+	unsigned int generation;
+	unsigned int size;
+};
+
+struct tree_snap {
+	unsigned int n;
+	struct tree_entry e[];
+};
+
+// Pre-order copy of the process tree. Returns -ENOSPC if cap is too small
+static int tree_copy(struct tree_snap *s, unsigned int cap){
+	struct task_struct *t;
+	long depth = 0;
+
+	s->n = 0;
+	read_lock(&tasklist_lock);
+	for (t = next_preorder(&init_task, &init_task, &depth); t != NULL;
+	     t = next_preorder(&init_task, t, &depth)){
+		if (s->n == cap){
+			read_unlock(&tasklist_lock);
+			return -ENOSPC;
+		}
+		s->e[s->n].pid = t->pid;
+		s->e[s->n].ppid = t->real_parent->tgid;
+		s->e[s->n].depth = depth;
+		s->n++;
+	}
+	read_unlock(&tasklist_lock);
+
+	return 0;
+}
+
+/**
+ *  Generations and subtree sizes in one pass: in pre-order a subtree is the run
+ *  of entries deeper than its root, so keep a stack of the open ancestors.
+ */
+static int tree_fill(struct tree_snap *s){
+	unsigned int *stack, top = 0, i, j, parent;
+
+	stack = kvmalloc_array(s->n + 1, sizeof(*stack), GFP_KERNEL);
+	if (stack == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i <= s->n; i++){
+		// Close the subtrees that end before entry i
+		while (top && (i == s->n || s->e[stack[top - 1]].depth >= s->e[i].depth)){
+			j = stack[--top];
+			s->e[j].size = i - j;
+		}
+		if (i == s->n)
+			break;
+
+		if (top){
+			parent = stack[top - 1];
+			s->e[i].generation = s->e[parent].generation + 1;
+		}
+		else{
+			// Children of the idle task: init, and kthreadd (same as generation_walk())
+			s->e[i].generation = (s->e[i].pid == 1) ? 1 : 2;
+		}
+		stack[top++] = i;
+	}
+
+	kvfree(stack);
+	return 0;
+}
+
+static struct tree_snap *tree_snapshot(void){
+	struct tree_snap *s;
 	struct task_struct *p;
+	unsigned int cap = 0;
+	int ret;
 
+	rcu_read_lock();
 	for_each_process(p)
-		if (p->pid == argpid) break;
+		cap++;
+	rcu_read_unlock();
 
-	for (; p->pid != 1; generation++) p = p -> parent;
-	
-	return generation;
+	// Room for the tasks forked meanwhile; start again if that is not enough
+	for (cap += cap / 8 + 64;; cap *= 2){
+		s = kvmalloc(struct_size(s, e, cap), GFP_KERNEL);
+		if (s == NULL)
+			return ERR_PTR(-ENOMEM);
+
+		ret = tree_copy(s, cap);
+		if (ret == 0)
+			break;
+		kvfree(s);
+	}
+
+	ret = tree_fill(s);
+	if (ret){
+		kvfree(s);
+		return ERR_PTR(ret);
+	}
+
+	return s;
+}
+
+static void *tree_start(struct seq_file *m, loff_t *pos){
+	struct tree_snap *s = m->private;
+
+	if (*pos == 0)
+		return SEQ_START_TOKEN;
+	if (*pos > s->n)
+		return NULL;
+
+	return &s->e[*pos - 1];
+}
+
+static void *tree_next(struct seq_file *m, void *v, loff_t *pos){
+	++*pos;
+	return tree_start(m, pos);
+}
+
+static void tree_stop(struct seq_file *m, void *v){
+}
+
+static int tree_show(struct seq_file *m, void *v){
+	struct tree_entry *e = v;
+
+	if (v == SEQ_START_TOKEN)
+		seq_puts(m, "pid ppid generation subtree\n");
+	else
+		seq_printf(m, "%d %d %u %u\n", e->pid, e->ppid, e->generation, e->size);
+
+	return 0;
 }
 
+static const struct seq_operations tree_sops = {
+	.start = tree_start,
+	.next = tree_next,
+	.stop = tree_stop,
+	.show = tree_show,
+};
+
+static int tree_open(struct inode *inode, struct file *f){
+	struct tree_snap *s;
+	int ret;
+
+	s = tree_snapshot();
+	if (IS_ERR(s))
+		return PTR_ERR(s);
+
+	ret = seq_open(f, &tree_sops);
+	if (ret){
+		kvfree(s);
+		return ret;
+	}
+	((struct seq_file *) f->private_data)->private = s;
+
+	return 0;
+}
+
+static int tree_release(struct inode *inode, struct file *f){
+	kvfree(((struct seq_file *) f->private_data)->private);
+	return seq_release(inode, f);
+}
+
+static const struct file_operations tree_fops = {
+	.owner = THIS_MODULE,
+	.open = tree_open,
+	.release = tree_release,
+	.read = seq_read,
+	.llseek = seq_lseek,
+};
+
 static int __init entry_point(void) {
+	int ret;
+
+	ret = cache_init();
+	if (ret)
+		return ret;
+
 	if(pid)
 		printk(KERN_DEBUG "PID: %d - Generation: %ld\n", pid, generation(pid));
 
+	debugfs_dir = debugfs_create_dir("generation", NULL);
+	debugfs_create_file("query", 0600, debugfs_dir, NULL, &query_fops);
+	debugfs_create_file("cache_stats", 0444, debugfs_dir, NULL, &cache_stats_fops);
+	debugfs_create_file("tree", 0444, debugfs_dir, NULL, &tree_fops);
+
 	return 0;
 }
 
 static void __exit exit_point(void) {
+	debugfs_remove_recursive(debugfs_dir);
+	cache_exit();
 	return;
 }
 
 module_init(entry_point);
 module_exit(exit_point);
-
@@ -31,67 +31,784 @@
 #include <linux/syscalls.h>
 #include <linux/kthread.h>
 #include <linux/slab.h>
+#include <linux/mempool.h>
+#include <linux/string.h>
+#include <linux/wait.h>
+#include <linux/llist.h>
+#include <linux/list.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/cpu.h>
+#include <linux/cpuhotplug.h>
+#include <linux/cpumask.h>
+#include <linux/rcupdate.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/completion.h>
+#include <linux/refcount.h>
+#include <linux/err.h>
+#include <linux/delay.h>
+#include <linux/compat.h>
 
 #define AUTHOR "Fernando Vanyo <fernando@fervagar.com>"
-#define DESC   "Simple Job queue for a unique kernel thread"
+#define DESC   "Simple Job queue for a pool of per-CPU kernel threads"
 
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR(AUTHOR);
 MODULE_DESCRIPTION(DESC);
 
-#define CHECK_EXIT					\
-	do{						\
-		set_current_state(TASK_INTERRUPTIBLE);	\
-		if (kthread_should_stop()){		\
-			break;				\
-		}					\
-	}while(0)
+// Queue-to-start latency histogram: bucket N counts jobs started in [2^N, 2^(N+1)) ns
+#define LAT_HIST_BUCKETS	40
 
-// List of Jobs for the worker thread //
+// Argument payloads up to this size are stored inside the job itself
+#define JOB_INLINE_ARGS		48
+
+// job_t flags
+#define JOB_ARGS_KMALLOC	(1U << 0)	// args points to a kmalloc'd copy
+
+// job_t states
+#define JOB_IDLE		0	// allocated, not submitted yet
+#define JOB_QUEUED		1
+#define JOB_RUNNING		2
+#define JOB_DONE		3
+#define JOB_CANCELLED		4
+
+// Priority classes, served strictly in this order
+#define JOB_PRIO_HIGH		0	// interactive / latency sensitive
+#define JOB_PRIO_NORMAL		1	// default
+#define JOB_PRIO_LOW		2	// housekeeping
+#define JOB_PRIO_NR		3
+
+// Stealing policies (see steal_policy)
+#define STEAL_NONE		0
+#define STEAL_NEIGHBOUR		1
+#define STEAL_BUSIEST		2
+
+static int nr_workers = 0;
+module_param(nr_workers, int, S_IRUGO);
+MODULE_PARM_DESC(nr_workers, "Maximum number of workers, one per online CPU (0: no limit)");
+
+static int steal_policy = STEAL_BUSIEST;
+module_param(steal_policy, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(steal_policy, "Idle worker policy: 0 no stealing, 1 first busy neighbour, 2 busiest worker");
+
+static int job_reserve = 64;
+module_param(job_reserve, int, S_IRUGO);
+MODULE_PARM_DESC(job_reserve, "Jobs preallocated for submissions under memory pressure (0: no reserve)");
+
+/**
+ *  Fan out N jobs and wait once: job_batch_init(), job_batch_add() on each job
+ *  before submitting it, then job_batch_wait(). The batch must outlive its jobs.
+ */
+struct job_batch {
+	atomic_t pending;	// submitted jobs not finished yet + 1 for the waiter
+	struct completion done;
+};
+
+// List of Jobs for the worker threads //
 typedef struct job_t {
 	void* (*func)(void* args);
 	void* args;
-	struct list_head list;
+	u64 queued_ns;		// ktime_get_ns() at submission
+	u64 deadline_ns;	// absolute ktime_get_ns() deadline, 0 for none
+	int prio;		// JOB_PRIO_*, JOB_PRIO_NORMAL after job_alloc()
+	unsigned int flags;
+	atomic_t state;		// JOB_*
+	refcount_t ref;		// the pool + one per handle (submit_job_handle)
+	void *result;		// what func returned, valid once done completes
+	struct completion done;
+	struct job_batch *batch;
+	struct llist_node node;	// in a worker inbox
+	union {
+		struct rb_node rb;	// in a worker run queue
+		struct list_head list;	// in a batch being moved between workers
+	};
+	char inline_args[JOB_INLINE_ARGS];
 } job_t;
 
+/**
+ *  One worker per CPU. Submitters push onto the inbox of the worker of their own
+ *  CPU without taking any lock; the worker moves the inbox into its run queue:
+ *  one tree per priority class, ordered by deadline (jobs without a deadline go
+ *  last, in submission order). Idle workers steal the most urgent half of a busy
+ *  worker's queue, so the owner and the thief only meet on the queue lock.
+ */
+struct job_worker {
+	struct task_struct *task;
+	struct llist_head inbox;	// lock-free submissions
+	spinlock_t lock;		// protects queue, taken by the owner and by thieves
+	struct rb_root_cached queue[JOB_PRIO_NR];
+	atomic_t nr_queued;		// jobs in inbox + queue, a hint for thieves
+	wait_queue_head_t wq;		// the worker sleeps here while it has nothing to do
+	bool active;			// accepting submissions (read under RCU)
+	bool kicked;			// a busy worker asked us to steal
+	unsigned int cpu;
+	unsigned long nr_run;
+	unsigned long nr_stolen;
+};
+
+static DEFINE_PER_CPU(struct job_worker, workers);
+static struct cpumask active_workers;	// CPUs with a running worker
+static struct cpumask idle_workers;	// ... that are sleeping right now
+static int nr_active;
+static bool pool_shutdown;
+static enum cpuhp_state hp_state;
+
+static struct kmem_cache *job_cachep;
+static mempool_t *job_pool;	// NULL when job_reserve is 0
 
-struct task_struct *task; // the worker kthread
-job_t jobs;
+// Jobs submitted and not finished nor cancelled yet, for job_flush_all()
+static atomic_t jobs_outstanding = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(flush_wq);
+static bool pool_draining;	// exit_point() is flushing, refuse new jobs
+
+static atomic64_t lat_hist[LAT_HIST_BUCKETS];
+static atomic64_t deadlines_met, deadlines_missed;
+static atomic64_t jobs_cancelled;
+static struct dentry *debugfs_dir;
 
 void generic_job(void);
+job_t *job_alloc(gfp_t gfp);
+void job_free(job_t *job_ptr);
+job_t *job_create(void* (*func)(void* args), const void *args, size_t len, gfp_t gfp);
+int submit_job(job_t *job_ptr);
+int submit_job_args(void* (*func)(void* args), const void *args, size_t len, gfp_t gfp);
+int submit_job_handle(job_t *job_ptr);
+void job_get(job_t *job_ptr);
+void job_put(job_t *job_ptr);
+int job_wait(job_t *job_ptr, void **result);
+int job_wait_timeout(job_t *job_ptr, unsigned long timeout, void **result);
+bool job_cancel(job_t *job_ptr);
+void job_flush_all(void);
+void job_batch_init(struct job_batch *batch);
+void job_batch_add(struct job_batch *batch, job_t *job_ptr);
+void job_batch_wait(struct job_batch *batch);
+
+EXPORT_SYMBOL(job_alloc);
+EXPORT_SYMBOL(job_free);
+EXPORT_SYMBOL(job_create);
+EXPORT_SYMBOL(submit_job);
+EXPORT_SYMBOL(submit_job_args);
+EXPORT_SYMBOL(submit_job_handle);
+EXPORT_SYMBOL(job_get);
+EXPORT_SYMBOL(job_put);
+EXPORT_SYMBOL(job_wait);
+EXPORT_SYMBOL(job_wait_timeout);
+EXPORT_SYMBOL(job_cancel);
+EXPORT_SYMBOL(job_flush_all);
+EXPORT_SYMBOL(job_batch_init);
+EXPORT_SYMBOL(job_batch_add);
+EXPORT_SYMBOL(job_batch_wait);
+
+/**
+ *  Allocate a zeroed job from the job_t cache. With GFP_ATOMIC (or any non
+ *  blocking gfp) the preallocated reserve is used when the cache is exhausted.
+ */
+job_t *job_alloc(gfp_t gfp){
+	job_t *job_ptr;
+
+	if (job_pool)
+		job_ptr = mempool_alloc(job_pool, gfp);
+	else
+		job_ptr = kmem_cache_alloc(job_cachep, gfp);
+
+	if (job_ptr != NULL){
+		memset(job_ptr, 0, sizeof(*job_ptr));
+		job_ptr->prio = JOB_PRIO_NORMAL;
+		refcount_set(&job_ptr->ref, 1);
+		init_completion(&job_ptr->done);
+	}
+
+	return job_ptr;
+}
+
+// Free a job that was never submitted. Submitted jobs are released with job_put()
+void job_free(job_t *job_ptr){
+	if (job_ptr == NULL)
+		return;
+
+	if (job_ptr->flags & JOB_ARGS_KMALLOC)
+		kfree(job_ptr->args);
+
+	if (job_pool)
+		mempool_free(job_ptr, job_pool);
+	else
+		kmem_cache_free(job_cachep, job_ptr);
+}
+
+/**
+ *  Allocate and fill a job. If len is 0, args is stored as an opaque pointer;
+ *  otherwise len bytes are copied, inside the job when they fit in
+ *  JOB_INLINE_ARGS (single allocation) or into a separate kmalloc'd buffer.
+ */
+job_t *job_create(void* (*func)(void* args), const void *args, size_t len, gfp_t gfp){
+	job_t *job_ptr = job_alloc(gfp);
+
+	if (job_ptr == NULL)
+		return NULL;
+
+	job_ptr->func = func;
+	if (len == 0){
+		job_ptr->args = (void *) args;
+	}
+	else if (len <= JOB_INLINE_ARGS){
+		memcpy(job_ptr->inline_args, args, len);
+		job_ptr->args = job_ptr->inline_args;
+	}
+	else{
+		job_ptr->args = kmemdup(args, len, gfp);
+		if (job_ptr->args == NULL){
+			job_free(job_ptr);
+			return NULL;
+		}
+		job_ptr->flags |= JOB_ARGS_KMALLOC;
+	}
+
+	return job_ptr;
+}
+
+static void account_latency(job_t *job_ptr){
+	u64 delta = ktime_get_ns() - job_ptr->queued_ns;
+	unsigned int bucket = delta ? ilog2(delta) : 0;
+
+	if (bucket >= LAT_HIST_BUCKETS)
+		bucket = LAT_HIST_BUCKETS - 1;
+	atomic64_inc(&lat_hist[bucket]);
+}
+
+static int lat_hist_show(struct seq_file *m, void *v){
+	int i;
+
+	seq_printf(m, "%16s %16s\n", ">= ns", "jobs");
+	for (i = 0; i < LAT_HIST_BUCKETS; i++){
+		s64 count = atomic64_read(&lat_hist[i]);
+
+		if (count)
+			seq_printf(m, "%16llu %16lld\n", i ? 1ULL << i : 0ULL, count);
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(lat_hist);
+
+static int deadlines_show(struct seq_file *m, void *v){
+	seq_printf(m, "met: %lld\nmissed: %lld\ncancelled: %lld\n",
+		   atomic64_read(&deadlines_met), atomic64_read(&deadlines_missed),
+		   atomic64_read(&jobs_cancelled));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(deadlines);
+
+static int workers_show(struct seq_file *m, void *v){
+	struct job_worker *w;
+	unsigned int cpu;
+
+	seq_printf(m, "%4s %6s %8s %12s %12s\n", "cpu", "active", "queued", "run", "stolen");
+	for_each_possible_cpu(cpu){
+		w = per_cpu_ptr(&workers, cpu);
+		if (!READ_ONCE(w->active) && !w->nr_run)
+			continue;
+		seq_printf(m, "%4u %6d %8d %12lu %12lu\n", cpu, READ_ONCE(w->active),
+			   atomic_read(&w->nr_queued), READ_ONCE(w->nr_run),
+			   READ_ONCE(w->nr_stolen));
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(workers);
+
+// Wake up a sleeping worker so it can steal from a busy one
+static void kick_worker(struct job_worker *w){
+	WRITE_ONCE(w->kicked, true);
+	wake_up(&w->wq);
+}
+
+static void kick_idle_worker(struct job_worker *busy){
+	unsigned int cpu;
+
+	if (READ_ONCE(steal_policy) == STEAL_NONE)
+		return;
+
+	for_each_cpu_wrap(cpu, &idle_workers, busy->cpu + 1){
+		if (cpu != busy->cpu){
+			kick_worker(per_cpu_ptr(&workers, cpu));
+			return;
+		}
+	}
+}
+
+// Pick the worker of the submitting CPU, or the next one if that CPU has none
+static struct job_worker *pick_worker(unsigned int this_cpu){
+	struct job_worker *w = per_cpu_ptr(&workers, this_cpu);
+	unsigned int cpu;
+
+	if (READ_ONCE(w->active))
+		return w;
+
+	for_each_cpu_wrap(cpu, &active_workers, this_cpu){
+		w = per_cpu_ptr(&workers, cpu);
+		if (READ_ONCE(w->active))
+			return w;
+	}
+	return NULL;
+}
+
+void job_get(job_t *job_ptr){
+	refcount_inc(&job_ptr->ref);
+}
+
+void job_put(job_t *job_ptr){
+	if (refcount_dec_and_test(&job_ptr->ref))
+		job_free(job_ptr);
+}
+
+// The job will not run (again): publish the result and wake every waiter
+static void job_complete(job_t *job_ptr, int state, void *result){
+	job_ptr->result = result;
+	atomic_set(&job_ptr->state, state);
+	complete_all(&job_ptr->done);
+
+	if (job_ptr->batch != NULL && atomic_dec_and_test(&job_ptr->batch->pending))
+		complete(&job_ptr->batch->done);
+
+	if (atomic_dec_and_test(&jobs_outstanding))
+		wake_up_all(&flush_wq);
+}
+
+/**
+ *  Queue a job on the pool. Safe to call concurrently from any number of CPUs
+ *  and from atomic context; the job goes to the worker of the calling CPU when
+ *  there is one. The job must come from job_alloc()/job_create() and is
+ *  released by the pool once it has run. Set job_ptr->prio and
+ *  job_ptr->deadline_ns before submitting to change its scheduling class.
+ *  Returns -ENODEV if no worker is running, -ESHUTDOWN while the module is
+ *  unloading; the job is not queued then and still belongs to the caller.
+ */
+int submit_job(job_t *job_ptr){
+	struct job_worker *w;
+
+	job_ptr->queued_ns = ktime_get_ns();
+	job_ptr->prio = clamp(job_ptr->prio, JOB_PRIO_HIGH, JOB_PRIO_LOW);
+
+	rcu_read_lock();
+	if (READ_ONCE(pool_draining)){
+		rcu_read_unlock();
+		return -ESHUTDOWN;
+	}
+	w = pick_worker(raw_smp_processor_id());
+	if (w == NULL){
+		rcu_read_unlock();
+		return -ENODEV;
+	}
+	atomic_set(&job_ptr->state, JOB_QUEUED);
+	atomic_inc(&jobs_outstanding);
+	if (job_ptr->batch != NULL)
+		atomic_inc(&job_ptr->batch->pending);
+	atomic_inc(&w->nr_queued);
+	// Only the producer that finds the inbox empty has to wake the worker up
+	if (llist_add(&job_ptr->node, &w->inbox))
+		wake_up(&w->wq);
+	rcu_read_unlock();
+
+	return 0;
+}
+
+// job_create() + submit_job(). Returns -ENOMEM if the job cannot be allocated
+int submit_job_args(void* (*func)(void* args), const void *args, size_t len, gfp_t gfp){
+	job_t *job_ptr;
+	int ret;
+
+	job_ptr = job_create(func, args, len, gfp);
+	if (job_ptr == NULL)
+		return -ENOMEM;
+
+	ret = submit_job(job_ptr);
+	if (ret < 0)
+		job_free(job_ptr);
+
+	return ret;
+}
+
+/**
+ *  Like submit_job(), but the caller keeps a reference to the job and can use
+ *  it as a handle: job_wait(), job_wait_timeout(), job_cancel(). The handle
+ *  must be released with job_put(). On error nothing changes, as in submit_job().
+ */
+int submit_job_handle(job_t *job_ptr){
+	int ret;
+
+	job_get(job_ptr);
+	ret = submit_job(job_ptr);
+	if (ret < 0)
+		refcount_dec(&job_ptr->ref);
+
+	return ret;
+}
+
+static int job_result(job_t *job_ptr, void **result){
+	if (atomic_read(&job_ptr->state) == JOB_CANCELLED)
+		return -ECANCELED;
+
+	if (result != NULL)
+		*result = job_ptr->result;
+	return 0;
+}
+
+// Wait for a job to finish. Returns 0 and what func returned, or -ECANCELED
+int job_wait(job_t *job_ptr, void **result){
+	wait_for_completion(&job_ptr->done);
+	return job_result(job_ptr, result);
+}
+
+// As job_wait(), giving up with -ETIMEDOUT after timeout jiffies
+int job_wait_timeout(job_t *job_ptr, unsigned long timeout, void **result){
+	if (!wait_for_completion_timeout(&job_ptr->done, timeout))
+		return -ETIMEDOUT;
+	return job_result(job_ptr, result);
+}
+
+/**
+ *  Cancel a job that has not started yet. Waiters wake up with -ECANCELED and
+ *  the worker drops the job when it reaches it. Returns false if the job is
+ *  already running or finished.
+ */
+bool job_cancel(job_t *job_ptr){
+	if (atomic_cmpxchg(&job_ptr->state, JOB_QUEUED, JOB_CANCELLED) != JOB_QUEUED)
+		return false;
+
+	atomic64_inc(&jobs_cancelled);
+	job_complete(job_ptr, JOB_CANCELLED, NULL);
+	return true;
+}
+
+// Wait until every submitted job has finished or been cancelled
+void job_flush_all(void){
+	wait_event(flush_wq, atomic_read(&jobs_outstanding) == 0);
+}
+
+void job_batch_init(struct job_batch *batch){
+	atomic_set(&batch->pending, 1);
+	init_completion(&batch->done);
+}
+
+// Must be called before the job is submitted
+void job_batch_add(struct job_batch *batch, job_t *job_ptr){
+	job_ptr->batch = batch;
+}
+
+// Wait until every job of the batch has finished or been cancelled
+void job_batch_wait(struct job_batch *batch){
+	if (!atomic_dec_and_test(&batch->pending))
+		wait_for_completion(&batch->done);
+}
+
+static inline u64 job_deadline_key(job_t *job_ptr){
+	return job_ptr->deadline_ns ? job_ptr->deadline_ns : U64_MAX;
+}
+
+// Insert in the run queue of its class, after any job with the same deadline
+static void worker_enqueue(struct job_worker *w, job_t *job_ptr){
+	struct rb_root_cached *root = &w->queue[job_ptr->prio];
+	struct rb_node **link = &root->rb_root.rb_node, *parent = NULL;
+	u64 key = job_deadline_key(job_ptr);
+	bool leftmost = true;
+
+	while (*link){
+		parent = *link;
+		if (key < job_deadline_key(rb_entry(parent, job_t, rb))){
+			link = &parent->rb_left;
+		}
+		else{
+			link = &parent->rb_right;
+			leftmost = false;
+		}
+	}
+	rb_link_node(&job_ptr->rb, parent, link);
+	rb_insert_color_cached(&job_ptr->rb, root, leftmost);
+}
+
+// Most urgent job: highest priority class, then earliest deadline
+static job_t *worker_dequeue(struct job_worker *w){
+	struct rb_node *node;
+	int prio;
+
+	for (prio = 0; prio < JOB_PRIO_NR; prio++){
+		node = rb_first_cached(&w->queue[prio]);
+		if (node != NULL){
+			rb_erase_cached(node, &w->queue[prio]);
+			return rb_entry(node, job_t, rb);
+		}
+	}
+	return NULL;
+}
+
+static bool worker_queue_empty(struct job_worker *w){
+	int prio;
+
+	for (prio = 0; prio < JOB_PRIO_NR; prio++)
+		if (!RB_EMPTY_ROOT(&w->queue[prio].rb_root))
+			return false;
+	return true;
+}
+
+// Move the inbox to the run queue. Called with w->lock held
+static void worker_refill(struct job_worker *w){
+	struct llist_node *batch;
+	job_t *job_ptr, *next;
+
+	// Take the whole inbox in one atomic exchange (llist is LIFO, restore FIFO order)
+	batch = llist_reverse_order(llist_del_all(&w->inbox));
+	llist_for_each_entry_safe(job_ptr, next, batch, node)
+		worker_enqueue(w, job_ptr);
+}
+
+// Move up to count jobs, most urgent first, to a list. Called with w->lock held
+static int worker_take(struct job_worker *w, struct list_head *batch, int count){
+	job_t *job_ptr;
+	int n = 0;
+
+	while (n < count && (job_ptr = worker_dequeue(w)) != NULL){
+		list_add_tail(&job_ptr->list, batch);
+		n++;
+	}
+	return n;
+}
+
+// Called with w->lock held
+static void worker_give(struct job_worker *w, struct list_head *batch){
+	job_t *job_ptr, *next;
+
+	list_for_each_entry_safe(job_ptr, next, batch, list){
+		list_del(&job_ptr->list);
+		worker_enqueue(w, job_ptr);
+	}
+}
+
+static job_t *worker_next_job(struct job_worker *w){
+	job_t *job_ptr;
+	bool more;
 
-static int main_thread(void *data){
+	spin_lock(&w->lock);
+	worker_refill(w);
+	job_ptr = worker_dequeue(w);
+	if (job_ptr != NULL)
+		atomic_dec(&w->nr_queued);
+	more = !worker_queue_empty(w);
+	spin_unlock(&w->lock);
+
+	// There is a backlog behind this job: let an idle worker take part of it
+	if (more)
+		kick_idle_worker(w);
+
+	return job_ptr;
+}
+
+static struct job_worker *find_victim(struct job_worker *w){
+	struct job_worker *v, *victim = NULL;
+	int policy = READ_ONCE(steal_policy);
+	int queued, max = 0;
+	unsigned int cpu;
+
+	if (policy == STEAL_NONE)
+		return NULL;
+
+	for_each_cpu_wrap(cpu, &active_workers, w->cpu + 1){
+		v = per_cpu_ptr(&workers, cpu);
+		if (v == w)
+			continue;
+		queued = atomic_read(&v->nr_queued);
+		if (queued > max){
+			victim = v;
+			max = queued;
+			if (policy == STEAL_NEIGHBOUR)
+				break;
+		}
+	}
+	return victim;
+}
+
+/**
+ *  Take half of the backlog of a busy worker. The victim is running a job, so
+ *  the most urgent of its queued jobs are the ones stuck behind it: take those.
+ *  Returns true if something was stolen.
+ */
+static bool worker_steal(struct job_worker *w){
+	struct job_worker *victim;
+	LIST_HEAD(stolen);
+	int n, count;
+
+	victim = find_victim(w);
+	if (victim == NULL)
+		return false;
+
+	spin_lock(&victim->lock);
+	worker_refill(victim);
+	count = (atomic_read(&victim->nr_queued) + 1) / 2;
+	n = worker_take(victim, &stolen, count);
+	atomic_sub(n, &victim->nr_queued);
+	spin_unlock(&victim->lock);
+
+	if (!n)
+		return false;
+
+	spin_lock(&w->lock);
+	worker_give(w, &stolen);
+	atomic_add(n, &w->nr_queued);
+	spin_unlock(&w->lock);
+	w->nr_stolen += n;
+
+	return true;
+}
+
+static bool worker_has_work(struct job_worker *w){
+	return !llist_empty(&w->inbox) || READ_ONCE(w->kicked) || kthread_should_stop();
+}
+
+static void run_job(struct job_worker *w, job_t *job_ptr){
 	void* (*func_ptr)(void* arg);
 	void* args;
+	void* result;
+
+	// Lost the race against job_cancel(): it has already been completed
+	if (atomic_cmpxchg(&job_ptr->state, JOB_QUEUED, JOB_RUNNING) != JOB_QUEUED){
+		job_put(job_ptr);
+		return;
+	}
+
+	account_latency(job_ptr);
+	func_ptr = job_ptr->func;
+	args = job_ptr->args;
+	result = func_ptr(args);
+
+	if (job_ptr->deadline_ns){
+		if (ktime_get_ns() > job_ptr->deadline_ns)
+			atomic64_inc(&deadlines_missed);
+		else
+			atomic64_inc(&deadlines_met);
+	}
+
+	job_complete(job_ptr, JOB_DONE, result);
+	// Drop the pool reference, handles may still hold the job
+	job_put(job_ptr);
+	w->nr_run++;
+}
+
+static int worker_thread(void *data){
+	struct job_worker *w = data;
 	job_t *job_ptr;
 
 	while(!kthread_should_stop()){
-		//do work
-		if(!list_empty(&jobs.list)){
-			CHECK_EXIT;
-			printk(KERN_DEBUG "[kernel thread] Oh... I have job! :)\n");
-
-			// Get a job
-			job_ptr = list_first_entry_or_null(&jobs.list, struct job_t, list);
-			if (job_ptr != NULL){
-				printk(KERN_DEBUG "[kernel thread] doing the job....\n");
-				func_ptr = job_ptr->func;
-				args = job_ptr->args;
-				func_ptr(args);
-				// Free the node
-				list_del(&job_ptr->list);
-				kfree(job_ptr);
-			}
+		job_ptr = worker_next_job(w);
+		if (job_ptr != NULL){
+			run_job(w, job_ptr);
+			continue;
 		}
-		else{
-			//printk(KERN_DEBUG "[kernel thread] List empty....\n");
-			// Wait 500 ms //
-			CHECK_EXIT;
-			schedule_timeout(0.5 * HZ);
+
+		if (worker_steal(w))
+			continue;
+
+		// Nothing local nor to steal: sleep until a job is queued or we are kicked
+		cpumask_set_cpu(w->cpu, &idle_workers);
+		wait_event_interruptible(w->wq, worker_has_work(w));
+		cpumask_clear_cpu(w->cpu, &idle_workers);
+		WRITE_ONCE(w->kicked, false);
+	}
+
+	printk(KERN_DEBUG "[%s] bye!!\n", current->comm);
+	return 0;
+}
+
+// -- CPU hotplug: one worker per online CPU, up to nr_workers -- //
+static int worker_start(unsigned int cpu){
+	struct job_worker *w = per_cpu_ptr(&workers, cpu);
+	struct task_struct *t;
+
+	if (pool_shutdown || w->active || (nr_workers > 0 && nr_active >= nr_workers))
+		return 0;
+
+	t = kthread_create_on_cpu(&worker_thread, w, cpu, "job_worker/%u");
+	if (IS_ERR(t)){
+		printk(KERN_ERR "Error creating the worker for CPU %u\n", cpu);
+		return PTR_ERR(t);
+	}
+
+	w->task = t;
+	nr_active++;
+	cpumask_set_cpu(cpu, &active_workers);
+	WRITE_ONCE(w->active, true);
+	wake_up_process(t);
+
+	return 0;
+}
+
+static int worker_stop(unsigned int cpu){
+	struct job_worker *w = per_cpu_ptr(&workers, cpu);
+	struct job_worker *target = NULL;
+	job_t *job_ptr, *next;
+	LIST_HEAD(leftovers);
+	unsigned int other;
+	int n;
+
+	if (!w->active)
+		return 0;
+
+	WRITE_ONCE(w->active, false);
+	cpumask_clear_cpu(cpu, &active_workers);
+	// After this no submitter can still be pushing into w->inbox
+	synchronize_rcu();
+
+	kthread_stop(w->task);
+	w->task = NULL;
+	nr_active--;
+	cpumask_clear_cpu(cpu, &idle_workers);
+	WRITE_ONCE(w->kicked, false);
+
+	// Give the slot to an online CPU that has no worker yet (nr_workers limit)
+	for_each_online_cpu(other){
+		if (other != cpu && !per_cpu(workers, other).active){
+			worker_start(other);
+			break;
+		}
+	}
+
+	spin_lock(&w->lock);
+	worker_refill(w);
+	worker_take(w, &leftovers, INT_MAX);
+	n = atomic_xchg(&w->nr_queued, 0);
+	spin_unlock(&w->lock);
+
+	if (list_empty(&leftovers))
+		return 0;
+
+	// Hand the backlog over to another worker
+	for_each_cpu(other, &active_workers){
+		target = per_cpu_ptr(&workers, other);
+		break;
+	}
+	if (target == NULL){
+		printk(KERN_WARNING "[job_list] no worker left, cancelling %d jobs\n", n);
+		list_for_each_entry_safe(job_ptr, next, &leftovers, list){
+			job_cancel(job_ptr);
+			job_put(job_ptr);
 		}
+		return 0;
 	}
 
-	printk(KERN_DEBUG "[kernel thread] bye!!\n");
+	spin_lock(&target->lock);
+	worker_give(target, &leftovers);
+	atomic_add(n, &target->nr_queued);
+	spin_unlock(&target->lock);
+	kick_worker(target);
+
 	return 0;
 }
 
@@ -101,13 +818,359 @@ void generic_job(){
 	return;
 }
 
-static int __init entry_point(void) {
+// -- Userspace submission: /dev/job_ring -- //
+
+/**
+ *  Userspace ABI. The device exposes one shared memory area per open file:
+ *  a header followed by a submission ring (SQ) and a completion ring (CQ),
+ *  at the offsets given in the header. Userspace fills SQEs and advances
+ *  sq_tail, then calls ioctl(JOB_RING_IOC_ENTER, n) to queue up to n of them
+ *  as jobs. Completions are posted to the CQ (cq_tail) and reaped by advancing
+ *  cq_head; poll() reports POLLIN while the CQ is not empty.
+ *  Indexes are free running; the slot is index & (entries - 1).
+ */
+struct job_ring_hdr {
+	__u32 sq_head;		// written by the kernel
+	__u32 sq_tail;		// written by userspace
+	__u32 sq_entries;
+	__u32 sq_off;		// byte offset of the SQE array
+	__u32 cq_head;		// written by userspace
+	__u32 cq_tail;		// written by the kernel
+	__u32 cq_entries;
+	__u32 cq_off;		// byte offset of the CQE array
+};
+
+struct job_ring_sqe {
+	__u32 type;		// JOB_RING_*
+	__u32 flags;		// JOB_RING_F_*
+	__u64 user_data;	// copied to the CQE
+	__u64 arg;
+	__u64 deadline_us;	// relative to JOB_RING_IOC_ENTER, 0 for none
+};
+
+struct job_ring_cqe {
+	__u64 user_data;
+	__s64 res;		// >= 0 on success, -errno otherwise
+};
+
+// Predefined job types
+#define JOB_RING_NOP		0	// res = 0
+#define JOB_RING_ECHO		1	// res = arg
+#define JOB_RING_DELAY		2	// sleep arg microseconds (max 1 s), res = 0
+#define JOB_RING_GENERIC	3	// run generic_job(), res = 0
+#define JOB_RING_NR_TYPES	4
+
+// SQE flags: priority class (default: normal)
+#define JOB_RING_F_HIGH		(1U << 0)
+#define JOB_RING_F_LOW		(1U << 1)
+
+#define JOB_RING_IOC_MAGIC	'J'
+#define JOB_RING_IOC_SIZE	_IOR(JOB_RING_IOC_MAGIC, 1, __u32)	// size to mmap
+#define JOB_RING_IOC_ENTER	_IO(JOB_RING_IOC_MAGIC, 2)		// arg: SQEs to submit
+
+#define JOB_RING_DEV_NAME	"job_ring"
+#define JOB_RING_MAX_ENTRIES	4096
+#define JOB_RING_MAX_DELAY_US	1000000
+#define JOB_RING_MAX_DEADLINE_US	(3600ULL * USEC_PER_SEC)
+
+static int ring_entries = 256;
+module_param(ring_entries, int, S_IRUGO);
+MODULE_PARM_DESC(ring_entries, "SQ entries per /dev/job_ring file, the CQ gets twice as many");
+
+struct job_ring_ctx {
+	struct kref ref;		// the open file + one per job in flight
+	struct job_ring_hdr *hdr;	// vmalloc_user'd, shared with userspace
+	struct job_ring_sqe *sqes;
+	struct job_ring_cqe *cqes;
+	size_t size;
+	u32 sq_entries, cq_entries;	// private copies, userspace may scribble on hdr
+	struct mutex sq_lock;		// serializes JOB_RING_IOC_ENTER
+	u32 sq_head;
+	spinlock_t cq_lock;		// protects cq_tail and inflight
+	u32 cq_tail;
+	u32 inflight;			// queued jobs whose CQE is not posted yet
+	wait_queue_head_t cq_wait;
+};
+
+// Arguments of a ring job, stored inline in the job_t
+struct ring_job_args {
+	struct job_ring_ctx *ctx;
+	struct job_ring_sqe sqe;
+};
+
+static void ring_free(struct kref *ref){
+	struct job_ring_ctx *ctx = container_of(ref, struct job_ring_ctx, ref);
+
+	vfree(ctx->hdr);
+	kfree(ctx);
+}
+
+static void ring_post(struct job_ring_ctx *ctx, u64 user_data, s64 res){
+	struct job_ring_cqe *cqe;
+
+	spin_lock(&ctx->cq_lock);
+	cqe = &ctx->cqes[ctx->cq_tail & (ctx->cq_entries - 1)];
+	cqe->user_data = user_data;
+	cqe->res = res;
+	ctx->cq_tail++;
+	ctx->inflight--;
+	// Publish the CQE before the new tail
+	smp_store_release(&ctx->hdr->cq_tail, ctx->cq_tail);
+	spin_unlock(&ctx->cq_lock);
+
+	wake_up_interruptible(&ctx->cq_wait);
+}
+
+static void* ring_job(void* data){
+	struct ring_job_args *a = data;
+	s64 res = 0;
+
+	switch (a->sqe.type){
+	case JOB_RING_NOP:
+		break;
+	case JOB_RING_ECHO:
+		res = a->sqe.arg;
+		break;
+	case JOB_RING_DELAY:
+		usleep_range(a->sqe.arg, a->sqe.arg + a->sqe.arg / 8 + 1);
+		break;
+	case JOB_RING_GENERIC:
+		generic_job();
+		break;
+	}
+
+	ring_post(a->ctx, a->sqe.user_data, res);
+	kref_put(&a->ctx->ref, ring_free);
+	return NULL;
+}
+
+// Reserve a CQ slot for one more job. Completions can then never overflow the CQ
+static bool ring_reserve_cqe(struct job_ring_ctx *ctx){
+	u32 pending;
+	bool ok;
+
+	spin_lock(&ctx->cq_lock);
+	pending = ctx->cq_tail - READ_ONCE(ctx->hdr->cq_head);
+	if (pending > ctx->cq_entries)
+		pending = ctx->cq_entries;	// bogus cq_head from userspace
+	ok = pending + ctx->inflight < ctx->cq_entries;
+	if (ok)
+		ctx->inflight++;
+	spin_unlock(&ctx->cq_lock);
+
+	return ok;
+}
+
+static long ring_enter(struct job_ring_ctx *ctx, unsigned long to_submit){
+	struct ring_job_args a = { .ctx = ctx };
+	u32 head, tail, avail;
+	long submitted = 0;
 	job_t *job_ptr;
-	
-	INIT_LIST_HEAD(&jobs.list);
+	int ret;
+
+	mutex_lock(&ctx->sq_lock);
+	head = ctx->sq_head;
+	// Pairs with the userspace store-release of sq_tail: SQEs are visible
+	tail = smp_load_acquire(&ctx->hdr->sq_tail);
+	avail = tail - head;
+	if (avail > ctx->sq_entries){
+		mutex_unlock(&ctx->sq_lock);
+		return -EINVAL;
+	}
+	if (avail > to_submit)
+		avail = to_submit;
 
-	task = kthread_create(&main_thread, NULL, "MyKernelThread");
-	wake_up_process(task);
+	while (submitted < avail && ring_reserve_cqe(ctx)){
+		memcpy(&a.sqe, &ctx->sqes[head & (ctx->sq_entries - 1)], sizeof(a.sqe));
+		head++;
+		submitted++;
+
+		if (a.sqe.type >= JOB_RING_NR_TYPES ||
+		    (a.sqe.flags & ~(JOB_RING_F_HIGH | JOB_RING_F_LOW)) ||
+		    (a.sqe.flags & JOB_RING_F_HIGH && a.sqe.flags & JOB_RING_F_LOW)){
+			ring_post(ctx, a.sqe.user_data, -EINVAL);
+			continue;
+		}
+		if (a.sqe.type == JOB_RING_DELAY && a.sqe.arg > JOB_RING_MAX_DELAY_US)
+			a.sqe.arg = JOB_RING_MAX_DELAY_US;
+
+		job_ptr = job_create(ring_job, &a, sizeof(a), GFP_KERNEL);
+		if (job_ptr == NULL){
+			ring_post(ctx, a.sqe.user_data, -ENOMEM);
+			continue;
+		}
+		if (a.sqe.flags & JOB_RING_F_HIGH)
+			job_ptr->prio = JOB_PRIO_HIGH;
+		else if (a.sqe.flags & JOB_RING_F_LOW)
+			job_ptr->prio = JOB_PRIO_LOW;
+		if (a.sqe.deadline_us)
+			job_ptr->deadline_ns = ktime_get_ns() + NSEC_PER_USEC *
+				min_t(u64, a.sqe.deadline_us, JOB_RING_MAX_DEADLINE_US);
+
+		kref_get(&ctx->ref);
+		ret = submit_job(job_ptr);
+		if (ret < 0){
+			job_free(job_ptr);
+			kref_put(&ctx->ref, ring_free);
+			ring_post(ctx, a.sqe.user_data, ret);
+		}
+	}
+
+	ctx->sq_head = head;
+	smp_store_release(&ctx->hdr->sq_head, head);
+	mutex_unlock(&ctx->sq_lock);
+
+	return submitted;
+}
+
+static int ring_open(struct inode *inode, struct file *f){
+	struct job_ring_ctx *ctx;
+	u32 sq_entries;
+	size_t sq_off, cq_off;
+
+	sq_entries = roundup_pow_of_two(clamp(ring_entries, 1, JOB_RING_MAX_ENTRIES));
+	sq_off = ALIGN(sizeof(struct job_ring_hdr), SMP_CACHE_BYTES);
+	cq_off = ALIGN(sq_off + sq_entries * sizeof(struct job_ring_sqe), SMP_CACHE_BYTES);
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (ctx == NULL)
+		return -ENOMEM;
+
+	ctx->sq_entries = sq_entries;
+	ctx->cq_entries = 2 * sq_entries;
+	ctx->size = PAGE_ALIGN(cq_off + ctx->cq_entries * sizeof(struct job_ring_cqe));
+	ctx->hdr = vmalloc_user(ctx->size);
+	if (ctx->hdr == NULL){
+		kfree(ctx);
+		return -ENOMEM;
+	}
+	ctx->sqes = (void *) ctx->hdr + sq_off;
+	ctx->cqes = (void *) ctx->hdr + cq_off;
+	ctx->hdr->sq_entries = ctx->sq_entries;
+	ctx->hdr->sq_off = sq_off;
+	ctx->hdr->cq_entries = ctx->cq_entries;
+	ctx->hdr->cq_off = cq_off;
+
+	kref_init(&ctx->ref);
+	mutex_init(&ctx->sq_lock);
+	spin_lock_init(&ctx->cq_lock);
+	init_waitqueue_head(&ctx->cq_wait);
+
+	f->private_data = ctx;
+	return 0;
+}
+
+static int ring_release(struct inode *inode, struct file *f){
+	struct job_ring_ctx *ctx = f->private_data;
+
+	// Jobs still in flight keep the context alive until they complete
+	kref_put(&ctx->ref, ring_free);
+	return 0;
+}
+
+static int ring_mmap(struct file *f, struct vm_area_struct *vma){
+	struct job_ring_ctx *ctx = f->private_data;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != ctx->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ctx->hdr, 0);
+}
+
+static __poll_t ring_poll(struct file *f, poll_table *wait){
+	struct job_ring_ctx *ctx = f->private_data;
+
+	poll_wait(f, &ctx->cq_wait, wait);
+	if (READ_ONCE(ctx->hdr->cq_head) != READ_ONCE(ctx->cq_tail))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+static long ring_ioctl(struct file *f, unsigned int cmd, unsigned long arg){
+	struct job_ring_ctx *ctx = f->private_data;
+
+	switch (cmd){
+	case JOB_RING_IOC_SIZE:
+		return put_user((__u32) ctx->size, (__u32 __user *) arg);
+	case JOB_RING_IOC_ENTER:
+		return ring_enter(ctx, arg);
+	}
+
+	return -ENOTTY;
+}
+
+static const struct file_operations ring_fops = {
+	.owner = THIS_MODULE,
+	.open = ring_open,
+	.release = ring_release,
+	.mmap = ring_mmap,
+	.poll = ring_poll,
+	.unlocked_ioctl = ring_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+};
+
+static struct miscdevice ring_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = JOB_RING_DEV_NAME,
+	.fops = &ring_fops,
+	.mode = 0600,
+};
+
+static int __init entry_point(void) {
+	struct job_worker *w;
+	unsigned int cpu;
+	int prio, ret;
+
+	job_cachep = KMEM_CACHE(job_t, SLAB_HWCACHE_ALIGN);
+	if (job_cachep == NULL)
+		return -ENOMEM;
+
+	if (job_reserve > 0){
+		job_pool = mempool_create_slab_pool(job_reserve, job_cachep);
+		if (job_pool == NULL){
+			kmem_cache_destroy(job_cachep);
+			return -ENOMEM;
+		}
+	}
+
+	for_each_possible_cpu(cpu){
+		w = per_cpu_ptr(&workers, cpu);
+		w->cpu = cpu;
+		init_llist_head(&w->inbox);
+		spin_lock_init(&w->lock);
+		for (prio = 0; prio < JOB_PRIO_NR; prio++)
+			w->queue[prio] = RB_ROOT_CACHED;
+		init_waitqueue_head(&w->wq);
+	}
+
+	// /sys/kernel/debug/job_list/{latency_hist,workers,deadlines}
+	debugfs_dir = debugfs_create_dir("job_list", NULL);
+	debugfs_create_file("latency_hist", 0444, debugfs_dir, NULL, &lat_hist_fops);
+	debugfs_create_file("workers", 0444, debugfs_dir, NULL, &workers_fops);
+	debugfs_create_file("deadlines", 0444, debugfs_dir, NULL, &deadlines_fops);
+
+	// Starts a worker on every online CPU and follows hotplug from now on
+	ret = cpuhp_setup_state(CPUHP_AP_ONLINE_DYN, "job_list:online", worker_start, worker_stop);
+	if (ret < 0){
+		printk(KERN_ERR "Error registering the CPU hotplug callbacks\n");
+		debugfs_remove_recursive(debugfs_dir);
+		mempool_destroy(job_pool);
+		kmem_cache_destroy(job_cachep);
+		return ret;
+	}
+	hp_state = ret;
+
+	ret = misc_register(&ring_dev);
+	if (ret < 0){
+		printk(KERN_ERR "Error registering /dev/%s\n", JOB_RING_DEV_NAME);
+		pool_shutdown = true;
+		cpuhp_remove_state(hp_state);
+		debugfs_remove_recursive(debugfs_dir);
+		mempool_destroy(job_pool);
+		kmem_cache_destroy(job_cachep);
+		return ret;
+	}
 
 	// wait 2 seconds
 	set_current_state(TASK_INTERRUPTIBLE);
@@ -115,26 +1178,29 @@ static int __init entry_point(void) {
 	// add a job to the queue
 	printk(KERN_DEBUG "[%s] OK. 2 seconds later, I add a job to the queue\n", current->comm);
 
-
-	job_ptr = (job_t *) kmalloc(sizeof(struct job_t), GFP_KERNEL);
-	if(job_ptr != NULL){
-		job_ptr->func = (void*)generic_job;
-		job_ptr->args = NULL;
-	}
-	// else -> error in kmalloc :S
-
-	list_add_tail(&job_ptr->list, &jobs.list);
+	if (submit_job_args((void*)generic_job, NULL, 0, GFP_KERNEL) < 0)
+		printk(KERN_ERR "[%s] Error queueing the generic job\n", current->comm);
 
 	return 0;
 }
 
 static void __exit exit_point(void) {
 	printk(KERN_DEBUG "[%s] bye!!\n", current->comm);
-	kthread_stop(task);
+	misc_deregister(&ring_dev);
+
+	// Refuse new jobs and let the queued ones finish before stopping the workers
+	WRITE_ONCE(pool_draining, true);
+	synchronize_rcu();
+	job_flush_all();
+
+	pool_shutdown = true;
+	cpuhp_remove_state(hp_state);
+	debugfs_remove_recursive(debugfs_dir);
+	mempool_destroy(job_pool);
+	kmem_cache_destroy(job_cachep);
 
 	return;
 }
 
 module_init(entry_point);
 module_exit(exit_point);
-
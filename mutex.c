@@ -30,9 +30,30 @@
 //#include <linux/init.h>
 //#include <linux/syscalls.h>
 #include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/rwsem.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+#include <linux/atomic.h>
+#include <linux/percpu_counter.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #define AUTHOR "Fernando Vanyo <fernando@fervagar.com>"
-#define DESC   "Simple \"Hello World\" of mutex in kernel"
+#define DESC   "Simple \"Hello World\" of mutex in kernel, and a lock primitive benchmark"
 
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR(AUTHOR);
@@ -45,41 +66,615 @@ static DEFINE_MUTEX(mutex);
 
 static int i = 0;
 
-static int hello_kthread(void *data){
-	printk(KERN_DEBUG "%s entered.\n", current->comm);
-	
+static bool demo_measure = false;
+module_param(demo_measure, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(demo_measure, "Account the CPU time the demo threads use while idle");
+
+/**
+ *  The demo runs once at load and again on every "start" written to
+ *  /sys/kernel/debug/lockbench/demo; "stop" cuts a run short. In between the
+ *  threads sleep on demo_wq, so an idle thread is never scheduled.
+ */
+static DECLARE_WAIT_QUEUE_HEAD(demo_wq);
+static unsigned int demo_gen = 1;	// one run per generation
+static bool demo_abort;
+
+struct demo_thread {
+	unsigned long runs;
+	bool idle;
+	// With demo_measure: time spent idle, CPU used meanwhile, sleeps it took
+	u64 idle_ns, idle_cpu_ns;
+	unsigned long idle_sleeps;
+};
+
+static struct demo_thread demo[2];
+
+static bool demo_should_wake(unsigned int gen){
+	return kthread_should_stop() || READ_ONCE(demo_gen) != gen;
+}
+
+static bool demo_should_abort(void){
+	return kthread_should_stop() || READ_ONCE(demo_abort);
+}
+
+static void demo_count(void){
 	mutex_lock(&mutex);
 
 	printk(KERN_DEBUG "[%s] mutex locked.\n", current->comm);
-	while(i < 10){
+	while(i < 10 && !demo_should_abort()){
 		printk(KERN_DEBUG "[%s] i = %d.\n", current->comm, i++);
-		schedule_timeout(0.2 * HZ); //Wait 200 ms
+		// Really sleeps 200 ms (the task state is set), unless told to stop
+		wait_event_interruptible_timeout(demo_wq, demo_should_abort(), msecs_to_jiffies(200));
 	}
 	
 	printk(KERN_DEBUG "[%s] unlocking mutex.\n", current->comm);
 	mutex_unlock(&mutex);
+}
+
+static int hello_kthread(void *data){
+	struct demo_thread *d = data;
+	unsigned int gen = 0;
+	unsigned long nvcsw = 0;
+	u64 t0 = 0, cpu0 = 0;
+	bool measure;
+
+	printk(KERN_DEBUG "%s entered.\n", current->comm);
 	
 	while(!kthread_should_stop()){
+		if (READ_ONCE(demo_gen) != gen){
+			gen = READ_ONCE(demo_gen);
+			demo_count();
+			d->runs++;
+			continue;
+		}
+
+		measure = READ_ONCE(demo_measure);
+		if (measure){
+			t0 = ktime_get_ns();
+			cpu0 = current->se.sum_exec_runtime;
+			nvcsw = current->nvcsw;
+		}
+		WRITE_ONCE(d->idle, true);
+		wait_event_interruptible(demo_wq, demo_should_wake(gen));
+		WRITE_ONCE(d->idle, false);
+		if (measure){
+			d->idle_ns += ktime_get_ns() - t0;
+			d->idle_cpu_ns += current->se.sum_exec_runtime - cpu0;
+			d->idle_sleeps += current->nvcsw - nvcsw;
+		}
+	}
+
+	return 0;
+}
+
+static ssize_t demo_write(struct file *f, const char __user *ubuf, size_t len, loff_t *off){
+	char buf[16];
+
+	if (len == 0 || len >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, len))
+		return -EFAULT;
+	buf[len] = '\0';
+
+	if (sysfs_streq(buf, "start")){
+		// Waits for a run in progress to finish
+		if (mutex_lock_interruptible(&mutex))
+			return -ERESTARTSYS;
+		i = 0;
+		WRITE_ONCE(demo_abort, false);
+		WRITE_ONCE(demo_gen, demo_gen + 1);
+		mutex_unlock(&mutex);
+	}
+	else if (sysfs_streq(buf, "stop")){
+		WRITE_ONCE(demo_abort, true);
+	}
+	else{
+		return -EINVAL;
+	}
+	wake_up_all(&demo_wq);
+
+	return len;
+}
+
+static int demo_show(struct seq_file *m, void *v){
+	struct task_struct *tasks[2] = { task1, task2 };
+	const struct demo_thread *d;
+	int n;
+
+	seq_printf(m, "%-10s %6s %6s %14s %14s %8s\n",
+		   "thread", "state", "runs", "idle_ns", "idle_cpu_ns", "sleeps");
+	for (n = 0; n < 2; n++){
+		d = &demo[n];
+		seq_printf(m, "%-10s %6s %6lu %14llu %14llu %8lu\n", tasks[n]->comm,
+			   READ_ONCE(d->idle) ? "idle" : "busy", d->runs,
+			   d->idle_ns, d->idle_cpu_ns, d->idle_sleeps);
+	}
+	return 0;
+}
+
+static int demo_open(struct inode *inode, struct file *f){
+	return single_open(f, demo_show, NULL);
+}
+
+static const struct file_operations demo_fops = {
+	.owner = THIS_MODULE,
+	.open = demo_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+	.write = demo_write,
+};
+
+/**
+ *  Lock benchmark: bench_threads threads hammer one primitive for bench_ms,
+ *  each operation being a read (read_pct % of them) or a write of a small
+ *  shared structure held for cs_ns, followed by think_ns outside the lock.
+ *  Run it by writing a variant name (or "all") to
+ *  /sys/kernel/debug/lockbench/run; the write returns when the run is over
+ *  and the numbers are in /sys/kernel/debug/lockbench/results.
+ *
+ *  The latency is the time spent acquiring: from before the lock call to the
+ *  start of the critical section (for atomic and percpu_counter, the operation
+ *  itself). Readers check that both fields of the structure match; "torn"
+ *  counts the ones that did not, which should stay 0 for all variants.
+ */
+#define BENCH_MAX_THREADS	256
+#define BENCH_SUB_BITS		2	// 4 histogram buckets per power of two
+#define BENCH_HIST_BUCKETS	((40 << BENCH_SUB_BITS) - (1 << BENCH_SUB_BITS))
+
+static int bench_threads = 4;
+module_param(bench_threads, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(bench_threads, "Benchmark threads");
+
+static bool bench_pin = true;
+module_param(bench_pin, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(bench_pin, "Pin benchmark thread N to the N-th online CPU (wrapping around)");
+
+static int cs_ns = 100;
+module_param(cs_ns, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(cs_ns, "Critical section length (ns)");
+
+static int think_ns = 0;
+module_param(think_ns, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(think_ns, "Time spent outside the lock between operations (ns)");
+
+static int read_pct = 90;
+module_param(read_pct, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(read_pct, "Percentage of read operations");
+
+static int bench_ms = 1000;
+module_param(bench_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(bench_ms, "Duration of a run (ms)");
+
+enum bench_variant {
+	BENCH_MUTEX,
+	BENCH_SPINLOCK,
+	BENCH_RWSEM,
+	BENCH_SEQLOCK,
+	BENCH_RCU,
+	BENCH_ATOMIC,
+	BENCH_PERCPU_COUNTER,
+	BENCH_NR
+};
+
+static const char * const bench_names[BENCH_NR] = {
+	[BENCH_MUTEX]		= "mutex",
+	[BENCH_SPINLOCK]	= "spinlock",
+	[BENCH_RWSEM]		= "rwsem",
+	[BENCH_SEQLOCK]		= "seqlock",
+	[BENCH_RCU]		= "rcu",
+	[BENCH_ATOMIC]		= "atomic",
+	[BENCH_PERCPU_COUNTER]	= "percpu_counter",
+};
+
+// What the locks protect: a writer bumps both fields, a reader expects them equal
+struct bench_data {
+	u64 a, b;
+	struct rcu_head rcu;
+};
+
+static DEFINE_MUTEX(bench_mutex);
+static DEFINE_SPINLOCK(bench_spin);
+static DECLARE_RWSEM(bench_rwsem);
+static DEFINE_SEQLOCK(bench_seq);
+static DEFINE_SPINLOCK(bench_rcu_lock);		// serializes RCU writers
+static struct bench_data bench_shared;
+static struct bench_data __rcu *bench_rcu;
+static atomic_long_t bench_atomic;
+static struct percpu_counter bench_pcpu;
+
+struct bench_thread {
+	struct task_struct *task;
+	enum bench_variant variant;
+	u32 rnd;
+	u64 ops, reads, torn, max_ns;
+	u64 hist[BENCH_HIST_BUCKETS];
+};
+
+struct bench_result {
+	bool valid;
+	int threads, cs_ns, think_ns, read_pct;
+	u64 ns;				// wall time of the run
+	u64 ops, reads, torn, max_ns;
+	u64 hist[BENCH_HIST_BUCKETS];
+};
+
+static struct bench_result results[BENCH_NR];
+static DEFINE_MUTEX(bench_run_lock);		// one run at a time, protects results
+static DECLARE_COMPLETION(bench_go);
+static bool bench_stop;
+static struct dentry *debugfs_dir;
+
+static unsigned int lat_bucket(u64 ns){
+	unsigned int e;
+
+	if (ns < (1 << BENCH_SUB_BITS))
+		return ns;
+	e = ilog2(ns);
+	if (e >= 40)
+		return BENCH_HIST_BUCKETS - 1;
+	return ((e - BENCH_SUB_BITS + 1) << BENCH_SUB_BITS) +
+	       ((ns >> (e - BENCH_SUB_BITS)) & ((1 << BENCH_SUB_BITS) - 1));
+}
+
+// Smallest latency that falls in bucket b
+static u64 lat_bucket_floor(unsigned int b){
+	unsigned int e, sub;
+
+	if (b < (1 << BENCH_SUB_BITS))
+		return b;
+	e = (b >> BENCH_SUB_BITS) + BENCH_SUB_BITS - 1;
+	sub = b & ((1 << BENCH_SUB_BITS) - 1);
+	return (u64)((1 << BENCH_SUB_BITS) + sub) << (e - BENCH_SUB_BITS);
+}
+
+static u32 bench_rand(struct bench_thread *t){
+	// xorshift32, cheaper than anything that would show up in the numbers
+	t->rnd ^= t->rnd << 13;
+	t->rnd ^= t->rnd >> 17;
+	t->rnd ^= t->rnd << 5;
+	return t->rnd;
+}
+
+static void cs_read(struct bench_thread *t, const struct bench_data *d){
+	u64 a = READ_ONCE(d->a);
+
+	if (cs_ns)
+		ndelay(cs_ns);
+	if (READ_ONCE(d->b) != a)
+		t->torn++;
+}
+
+static void cs_write(struct bench_data *d){
+	WRITE_ONCE(d->a, d->a + 1);
+	if (cs_ns)
+		ndelay(cs_ns);
+	WRITE_ONCE(d->b, d->b + 1);
+}
+
+// One operation; returns the acquisition latency
+static u64 bench_op(struct bench_thread *t, bool read){
+	struct bench_data *d, *old;
+	unsigned int seq;
+	u64 a, b;
+	u64 t0 = ktime_get_ns(), t1;
+
+	switch (t->variant){
+	case BENCH_MUTEX:
+		mutex_lock(&bench_mutex);
+		t1 = ktime_get_ns();
+		if (read)
+			cs_read(t, &bench_shared);
+		else
+			cs_write(&bench_shared);
+		mutex_unlock(&bench_mutex);
+		break;
+	case BENCH_SPINLOCK:
+		spin_lock(&bench_spin);
+		t1 = ktime_get_ns();
+		if (read)
+			cs_read(t, &bench_shared);
+		else
+			cs_write(&bench_shared);
+		spin_unlock(&bench_spin);
+		break;
+	case BENCH_RWSEM:
+		if (read){
+			down_read(&bench_rwsem);
+			t1 = ktime_get_ns();
+			cs_read(t, &bench_shared);
+			up_read(&bench_rwsem);
+		}
+		else{
+			down_write(&bench_rwsem);
+			t1 = ktime_get_ns();
+			cs_write(&bench_shared);
+			up_write(&bench_rwsem);
+		}
+		break;
+	case BENCH_SEQLOCK:
+		if (read){
+			// Optimistic: the latency is the time it took to get a consistent snapshot
+			do {
+				seq = read_seqbegin(&bench_seq);
+				a = READ_ONCE(bench_shared.a);
+				if (cs_ns)
+					ndelay(cs_ns);
+				b = READ_ONCE(bench_shared.b);
+			} while (read_seqretry(&bench_seq, seq));
+			t1 = ktime_get_ns();
+			if (a != b)
+				t->torn++;
+		}
+		else{
+			write_seqlock(&bench_seq);
+			t1 = ktime_get_ns();
+			cs_write(&bench_shared);
+			write_sequnlock(&bench_seq);
+		}
+		break;
+	case BENCH_RCU:
+		if (read){
+			rcu_read_lock();
+			t1 = ktime_get_ns();
+			cs_read(t, rcu_dereference(bench_rcu));
+			rcu_read_unlock();
+		}
+		else{
+			// Copy, update, publish; the old copy is freed after a grace period
+			d = kmalloc(sizeof(*d), GFP_KERNEL);
+			if (d == NULL)
+				return 0;
+			spin_lock(&bench_rcu_lock);
+			t1 = ktime_get_ns();
+			old = rcu_dereference_protected(bench_rcu, lockdep_is_held(&bench_rcu_lock));
+			d->a = old->a;
+			d->b = old->b;
+			cs_write(d);
+			rcu_assign_pointer(bench_rcu, d);
+			spin_unlock(&bench_rcu_lock);
+			kfree_rcu(old, rcu);
+		}
+		break;
+	case BENCH_ATOMIC:
+		if (read)
+			atomic_long_read(&bench_atomic);
+		else
+			atomic_long_inc(&bench_atomic);
+		t1 = ktime_get_ns();
+		break;
+	case BENCH_PERCPU_COUNTER:
+		// Reads are the cheap approximate ones, percpu_counter_sum() would walk all CPUs
+		if (read)
+			percpu_counter_read(&bench_pcpu);
+		else
+			percpu_counter_inc(&bench_pcpu);
+		t1 = ktime_get_ns();
+		break;
+	default:
+		return 0;
+	}
+
+	return t1 - t0;
+}
+
+static int bench_kthread(void *data){
+	struct bench_thread *t = data;
+	int pct = READ_ONCE(read_pct), think = READ_ONCE(think_ns);
+	bool read;
+	u64 lat;
+
+	wait_for_completion(&bench_go);
+
+	while (!READ_ONCE(bench_stop)){
+		read = bench_rand(t) % 100 < pct;
+		lat = bench_op(t, read);
+		t->hist[lat_bucket(lat)]++;
+		t->max_ns = max(t->max_ns, lat);
+		t->ops++;
+		t->reads += read;
+		if (think)
+			ndelay(think);
+		cond_resched();
+	}
+
+	// Done: sleep until the runner has collected the numbers
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()){
 		schedule();
-		//!\\ Without setting interruptible, it uses a lot of cpu... bad idea for general purposes
 		set_current_state(TASK_INTERRUPTIBLE);
 	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+// Called with bench_run_lock held
+static int bench_run(enum bench_variant variant){
+	int nr = clamp(READ_ONCE(bench_threads), 1, BENCH_MAX_THREADS);
+	struct bench_result *res = &results[variant];
+	struct bench_thread *threads, *t;
+	int i, b, cpu = -1, ret = 0;
+	u64 start;
+
+	threads = kvcalloc(nr, sizeof(*threads), GFP_KERNEL);
+	if (threads == NULL)
+		return -ENOMEM;
+
+	reinit_completion(&bench_go);
+	WRITE_ONCE(bench_stop, false);
+
+	for (i = 0; i < nr; i++){
+		t = &threads[i];
+		t->variant = variant;
+		t->rnd = 0x9e3779b9 * (i + 1);
+		t->task = kthread_create(bench_kthread, t, "lockbench/%d", i);
+		if (IS_ERR(t->task)){
+			ret = PTR_ERR(t->task);
+			t->task = NULL;
+			break;
+		}
+		if (bench_pin){
+			cpu = cpumask_next(cpu, cpu_online_mask);
+			if (cpu >= nr_cpu_ids)
+				cpu = cpumask_first(cpu_online_mask);
+			kthread_bind(t->task, cpu);
+		}
+		wake_up_process(t->task);
+	}
 
+	// Also releases the threads already created if something went wrong
+	start = ktime_get_ns();
+	complete_all(&bench_go);
+	if (ret == 0)
+		msleep(max(READ_ONCE(bench_ms), 1));
+	WRITE_ONCE(bench_stop, true);
+
+	memset(res, 0, sizeof(*res));
+	res->ns = ktime_get_ns() - start;
+	for (i = 0; i < nr && threads[i].task != NULL; i++){
+		t = &threads[i];
+		kthread_stop(t->task);
+		res->ops += t->ops;
+		res->reads += t->reads;
+		res->torn += t->torn;
+		res->max_ns = max(res->max_ns, t->max_ns);
+		for (b = 0; b < BENCH_HIST_BUCKETS; b++)
+			res->hist[b] += t->hist[b];
+	}
+	res->threads = nr;
+	res->cs_ns = READ_ONCE(cs_ns);
+	res->think_ns = READ_ONCE(think_ns);
+	res->read_pct = READ_ONCE(read_pct);
+	res->valid = (ret == 0);
+
+	kvfree(threads);
+	return ret;
+}
+
+static ssize_t run_write(struct file *f, const char __user *ubuf, size_t len, loff_t *off){
+	char buf[32];
+	int v, ret = 0;
+	bool all;
+
+	if (len == 0 || len >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, len))
+		return -EFAULT;
+	buf[len] = '\0';
+
+	all = sysfs_streq(buf, "all");
+	for (v = 0; v < BENCH_NR; v++)
+		if (all || sysfs_streq(buf, bench_names[v]))
+			break;
+	if (v == BENCH_NR)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&bench_run_lock))
+		return -ERESTARTSYS;
+	for (; v < BENCH_NR && ret == 0; v++){
+		ret = bench_run(v);
+		if (!all)
+			break;
+	}
+	mutex_unlock(&bench_run_lock);
+
+	return ret ? ret : len;
+}
+
+static const struct file_operations run_fops = {
+	.owner = THIS_MODULE,
+	.write = run_write,
+};
+
+static u64 hist_percentile(const struct bench_result *res, unsigned int permille){
+	u64 want = div_u64(res->ops * permille + 999, 1000), seen = 0;
+	unsigned int b;
+
+	for (b = 0; b < BENCH_HIST_BUCKETS; b++){
+		seen += res->hist[b];
+		if (seen >= want && seen > 0)
+			return lat_bucket_floor(b);
+	}
+	return res->max_ns;
+}
+
+static int results_show(struct seq_file *m, void *v){
+	const struct bench_result *res;
+	int i;
+
+	seq_printf(m, "%-15s %7s %6s %6s %5s %12s %8s %8s %8s %8s %10s %8s\n",
+		   "variant", "threads", "cs_ns", "think", "read%", "ops/s",
+		   "p50_ns", "p90_ns", "p99_ns", "p999_ns", "max_ns", "torn");
+
+	mutex_lock(&bench_run_lock);
+	for (i = 0; i < BENCH_NR; i++){
+		res = &results[i];
+		if (!res->valid)
+			continue;
+		seq_printf(m, "%-15s %7d %6d %6d %5d %12llu %8llu %8llu %8llu %8llu %10llu %8llu\n",
+			   bench_names[i], res->threads, res->cs_ns, res->think_ns, res->read_pct,
+			   div64_u64(res->ops * NSEC_PER_SEC, max_t(u64, res->ns, 1)),
+			   hist_percentile(res, 500), hist_percentile(res, 900),
+			   hist_percentile(res, 990), hist_percentile(res, 999),
+			   res->max_ns, res->torn);
+	}
+	mutex_unlock(&bench_run_lock);
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(results);
 
 static int __init entry_point(void) {
-	task1 = kthread_create(&hello_kthread, NULL, "Thread 1");
-	task2 = kthread_create(&hello_kthread, NULL, "Thread 2");
+	struct bench_data *d;
+	int ret;
+
+	d = kzalloc(sizeof(*d), GFP_KERNEL);
+	if (d == NULL)
+		return -ENOMEM;
+	RCU_INIT_POINTER(bench_rcu, d);
+	ret = percpu_counter_init(&bench_pcpu, 0, GFP_KERNEL);
+	if (ret){
+		kfree(d);
+		return ret;
+	}
+
+	// /sys/kernel/debug/lockbench/{run,results,demo}
+	debugfs_dir = debugfs_create_dir("lockbench", NULL);
+	debugfs_create_file("run", 0200, debugfs_dir, NULL, &run_fops);
+	debugfs_create_file("results", 0444, debugfs_dir, NULL, &results_fops);
+
+	task1 = kthread_create(&hello_kthread, &demo[0], "Thread 1");
+	if (IS_ERR(task1)){
+		ret = PTR_ERR(task1);
+		goto err_bench;
+	}
+	task2 = kthread_create(&hello_kthread, &demo[1], "Thread 2");
+	if (IS_ERR(task2)){
+		ret = PTR_ERR(task2);
+		kthread_stop(task1);
+		goto err_bench;
+	}
 	wake_up_process(task1);
 	wake_up_process(task2);
 
+	debugfs_create_file("demo", 0600, debugfs_dir, NULL, &demo_fops);
+
 	return 0;
+
+err_bench:
+	debugfs_remove_recursive(debugfs_dir);
+	percpu_counter_destroy(&bench_pcpu);
+	kfree(d);
+	return ret;
 }
 
 static void __exit exit_point(void) {
+	debugfs_remove_recursive(debugfs_dir);
 	kthread_stop(task1);
 	kthread_stop(task2);
+	percpu_counter_destroy(&bench_pcpu);
+	// Pending kfree_rcu()s of older copies don't need the module
+	kfree(rcu_dereference_protected(bench_rcu, 1));
 	return;
 }
 
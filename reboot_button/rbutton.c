@@ -33,20 +33,71 @@
  *      # echo 0 > /proc/reboot_flag  :: Disables the button functionality
  *      # echo 1 > /proc/reboot_flag  :: Enables the button functionality
  *  This is useful if the machine is performing some important work and
- *  the user wants to disable the button temporally.
+ *  the user wants to disable the button temporally. The same flag is
+ *  /sys/module/rbutton/parameters/reboot_flag.
+ *
+ *  Every press is also delivered as a binary record (struct rbutton_event)
+ *  through /dev/rbutton, which supports poll()/epoll, so a supervisor can
+ *  react to presses without polling /proc.
  *
  *  In addition, it has 2 leds in order to indicate if the button is enabled or not
+ *
+ *  There can be more buttons and LEDs, each button with its own action:
+ *  "reboot" (the above), "event" (only the /dev/rbutton record) or "ledN"
+ *  (toggle LED N). They come from a device tree node
+ *      rbutton {
+ *              compatible = "fervagar,rbutton";
+ *              button-gpios = <&gpio 2 GPIO_ACTIVE_HIGH>, <&gpio 17 GPIO_ACTIVE_HIGH>;
+ *              button-actions = "reboot", "led2";
+ *              led-gpios = <&gpio 4 GPIO_ACTIVE_HIGH>, <&gpio 3 GPIO_ACTIVE_HIGH>,
+ *                          <&gpio 27 GPIO_ACTIVE_HIGH>;
+ *      };
+ *  or, if there is none, from the buttons/button_actions/leds parameters
+ *  (global GPIO numbers). LED 0 is the green one and LED 1 the red one.
+ *
+ *  The LEDs are driven by patterns (blink, heartbeat, the countdown before a
+ *  reboot, error codes) from static step tables, all of them on one hrtimer
+ *  that is only armed while some pattern runs. They can be set by hand in
+ *  /sys/kernel/debug/rbutton/leds ("<led> <pattern>" or "<led> off"). The
+ *  LED GPIOs can't be on a controller that sleeps (I2C expanders and such).
+ *
+ *  Buttons are debounced in the hard IRQ handler (edges closer than
+ *  debounce_ms to the last accepted one are dropped) and the press is handled
+ *  in the IRQ thread, with no allocation. /sys/kernel/debug/rbutton/ has the
+ *  counters and the IRQ-to-action latency histogram.
+ *
+ *  Testing without the hardware, on gpio-sim: create a chip with 3 lines in
+ *  configfs (/sys/kernel/config/gpio-sim), load the module with buttons=
+ *  and leds= set to the global numbers of its lines and dry_run=1, then
+ *  press the button with
+ *      # echo pull-down > /sys/devices/platform/gpio-sim.0/gpiochipN/sim_gpio0/pull
+ *  (after a pull-up), and look at the LEDs in the 'value' files next to it.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/interrupt.h>
 #include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
+#include <linux/of.h>
 
 #include <linux/slab.h>
 #include <linux/workqueue.h>
 #include <linux/proc_fs.h>
 #include <linux/reboot.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/hrtimer.h>
+#include <linux/version.h>
 
 #define AUTHOR "Fernando Vanyo <fernando@fervagar.com>"
 #define DESC   "Reboot Button Module"
@@ -56,234 +107,909 @@ MODULE_AUTHOR(AUTHOR);
 MODULE_DESCRIPTION(DESC);
 
 #define GPIO_GLED_PIN_N         (4)    // Green LED:    GPIO 4; PIN 7
-#define GPIO_GLED_PIN_D         "Green LED for 'Reboot Button'"
 #define GPIO_RLED_PIN_N         (3)    // Red LED:      GPIO 3; PIN 5
-#define GPIO_RLED_PIN_D         "Red LED for 'Reboot Button'"
+#define GPIO_LED_PIN_D          "LED for 'Reboot Button'"
 
 #define GPIO_INT_PIN_N          (2)    // Interruption: GPIO 2; PIN 3
 #define GPIO_INT_PIN_D          "Reboot Button GPIO PIN"
-#define GPIO_INT_DEVICE_D       (NULL)
+
+#define RB_OF_COMPATIBLE        "fervagar,rbutton"
+#define RB_MAX_BUTTONS          16
+#define RB_MAX_LEDS             16
+
+#define LED_GREEN               0
+#define LED_RED                 1
 
 #define PROC_RB_FILENAME       "reboot_flag"
 
 #define REBOOT_DELAY            (2 * HZ)     // 2 seconds
 
+// IRQ-to-action latency histogram: bucket N counts presses handled in [2^N, 2^(N+1)) ns
+#define LAT_HIST_BUCKETS        40
+
+static int buttons[RB_MAX_BUTTONS] = { GPIO_INT_PIN_N };
+static int nr_buttons_param = 1;
+module_param_array(buttons, int, &nr_buttons_param, S_IRUGO);
+MODULE_PARM_DESC(buttons, "GPIOs of the buttons (without a device tree node)");
+
+static char *button_actions[RB_MAX_BUTTONS] = { "reboot" };
+static int nr_actions_param = 1;
+module_param_array(button_actions, charp, &nr_actions_param, S_IRUGO);
+MODULE_PARM_DESC(button_actions, "Action of each button: reboot, event or ledN (default: reboot)");
+
+static int leds[RB_MAX_LEDS] = { GPIO_GLED_PIN_N, GPIO_RLED_PIN_N };
+static int nr_leds_param = 2;
+module_param_array(leds, int, &nr_leds_param, S_IRUGO);
+MODULE_PARM_DESC(leds, "GPIOs of the LEDs, green and red first (without a device tree node)");
+
+static int debounce_ms = 50;
+module_param(debounce_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(debounce_ms, "Edges closer than this to the last accepted press are bounces (ms)");
+
+static bool dry_run = false;
+module_param(dry_run, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(dry_run, "Don't really reboot (for testing, e.g. on gpio-sim)");
+
 static bool reboot_flag = true;
-static int irq_number = 0;
-static struct work_struct ws;  // For the Work Queue
-static atomic_t ws_in_use = ATOMIC_INIT(0);
+module_param(reboot_flag, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(reboot_flag, "Button enabled (same as /proc/reboot_flag)");
+
+static atomic_t ws_in_use = ATOMIC_INIT(0);     // a reboot action is pending
 static struct proc_dir_entry *proc_entry;
+static struct dentry *debugfs_dir;
 //static struct mutex rb_mutex;
 
+enum rb_action {
+        RB_ACT_REBOOT,
+        RB_ACT_EVENT,
+        RB_ACT_LED,
+        RB_NR_ACTIONS
+};
+
+struct rb_button {
+        struct gpio_desc *gpiod;
+        int irq;                        // > 0 once requested
+        enum rb_action action;
+        int led;                        // RB_ACT_LED: LED to toggle
+        bool from_fw;                   // gpiod_put() it, else gpio_free()
+        // Only touched by the hard IRQ handler, which doesn't nest for one line
+        u64 last_press_ns;
+        u64 press_ns;                   // for the IRQ thread (IRQF_ONESHOT)
+        unsigned long presses, bounces, busy;
+};
+
+struct rb_pattern;
+
+struct rb_led {
+        struct gpio_desc *gpiod;
+        bool from_fw;
+        bool on;
+        // Pattern state, under led_lock
+        const struct rb_pattern *pattern;
+        void (*done)(void);             // called when a finite pattern ends
+        unsigned int step, pass;
+        ktime_t deadline;               // of the current step
+};
+
+// The IRQ's dev_id is its rb_button, so no lookup is needed on a press
+static struct rb_button rb_buttons[RB_MAX_BUTTONS];
+static int rb_nr_buttons;
+static struct rb_led rb_leds[RB_MAX_LEDS];
+static int rb_nr_leds;
+
+static atomic64_t lat_hist[LAT_HIST_BUCKETS];
+
 // -- Functions related with the procfs -- //
 static ssize_t procfs_read(struct file *f, char __user *buf, size_t len, loff_t *off);
 static ssize_t procfs_write(struct file *f, const char __user *buf, size_t len, loff_t *off);
 
 /**
- *  NOTE: This function is quite simple... but if we want to have a good, well written procfsread function
- *  we will need to apply more logic. 
+ *  The position is the reader's own (*off), and the text is built on the
+ *  stack: concurrent readers don't interfere and nothing is allocated.
  */
 static ssize_t procfs_read(struct file *f, char __user *buf, size_t len, loff_t *off) {
-        static ssize_t written = 0;
+        char state[16];
+        int n;
 
-        if(written) {
-                return (written = 0);   // Stop reading
-        }
+        n = scnprintf(state, sizeof(state), "%s\n", (READ_ONCE(reboot_flag) ? "Enabled" : "Disabled"));
 
-        if((written = sprintf(buf, "%s\n", ((reboot_flag)? "Enabled" : "Disabled"))) <= 0) {
-                return -EFAULT;
-        }
-
-        return written;
+        return simple_read_from_buffer(buf, len, off, state, n);
 }
 
 static ssize_t procfs_write(struct file *f, const char __user *buf, size_t len, loff_t *off) {
-        int first_byte;
+        char first_byte;
 
         if(len > 0) {
-                first_byte = (int) *buf;
-                reboot_flag = ('1' == ((char) first_byte));
+                if(get_user(first_byte, buf)) {
+                        return -EFAULT;
+                }
+                WRITE_ONCE(reboot_flag, ('1' == first_byte));
         }
 
         return len;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+static const struct proc_ops pfops = {
+        .proc_write = procfs_write,
+        .proc_read = procfs_read,
+        .proc_lseek = default_llseek,
+};
+#else
 static const struct file_operations pfops = {
-        write: (*procfs_write),
-        read: (*procfs_read),
+        .owner = THIS_MODULE,
+        .write = procfs_write,
+        .read = procfs_read,
+        .llseek = default_llseek,
+};
+#endif
+
+// -- Press records for /dev/rbutton -- //
+
+struct rbutton_event {
+        __u64 time_ns;          // CLOCK_MONOTONIC, when the button was pressed
+        __u32 seq;              // increases by one per record, a gap means records were lost
+        __u16 action;           // RBUTTON_EV_*
+        __u16 button;           // index of the button
+};
+
+#define RBUTTON_EV_REBOOT       0       // enabled: reboot scheduled
+#define RBUTTON_EV_DISABLED     1       // disabled: only the red LED
+#define RBUTTON_EV_BUSY         2       // ignored, a reboot was already pending
+#define RBUTTON_EV_USER         3       // "event" button
+#define RBUTTON_EV_LED          4       // "ledN" button, LED toggled
+
+#define RBUTTON_DEV_NAME        "rbutton"
+#define EVENT_RING_SIZE         64      // power of 2
+#define EVENT_READ_BATCH        8       // records copied per lock hold
+
+/**
+ *  One ring shared by all readers, each open file has its own position in it
+ *  (the seq of the next record). Readers that fall more than EVENT_RING_SIZE
+ *  records behind skip ahead and see the gap in 'seq'.
+ */
+static struct rbutton_event events[EVENT_RING_SIZE];
+static u32 events_head;                 // seq of the next record
+static DEFINE_SPINLOCK(events_lock);
+static DECLARE_WAIT_QUEUE_HEAD(events_wq);
+
+static void event_emit(u64 time_ns, u16 action, u16 button) {
+        struct rbutton_event *ev;
+        unsigned long flags;
+
+        spin_lock_irqsave(&events_lock, flags);
+        ev = &events[events_head & (EVENT_RING_SIZE - 1)];
+        ev->time_ns = time_ns;
+        ev->seq = events_head;
+        ev->action = action;
+        ev->button = button;
+        events_head++;
+        spin_unlock_irqrestore(&events_lock, flags);
+
+        wake_up_interruptible(&events_wq);
+}
+
+static int events_open(struct inode *inode, struct file *f) {
+        u32 *pos = kmalloc(sizeof(*pos), GFP_KERNEL);
+
+        if(pos == NULL) {
+                return -ENOMEM;
+        }
+        // Only presses from now on
+        *pos = READ_ONCE(events_head);
+        f->private_data = pos;
+
+        return nonseekable_open(inode, f);
+}
+
+static int events_release(struct inode *inode, struct file *f) {
+        kfree(f->private_data);
+        return 0;
+}
+
+static bool events_pending(u32 *pos) {
+        return READ_ONCE(events_head) != READ_ONCE(*pos);
+}
+
+static ssize_t events_read(struct file *f, char __user *buf, size_t len, loff_t *off) {
+        struct rbutton_event batch[EVENT_READ_BATCH];
+        size_t max = len / sizeof(struct rbutton_event), done = 0;
+        u32 *pos = f->private_data;
+        unsigned long flags;
+        unsigned int n;
+        int ret;
+
+        if(max == 0) {
+                return -EINVAL;
+        }
+
+        while(!events_pending(pos)) {
+                if(f->f_flags & O_NONBLOCK) {
+                        return -EAGAIN;
+                }
+                ret = wait_event_interruptible(events_wq, events_pending(pos));
+                if(ret) {
+                        return ret;
+                }
+        }
+
+        while(done < max) {
+                spin_lock_irqsave(&events_lock, flags);
+                if(events_head - *pos > EVENT_RING_SIZE) {
+                        *pos = events_head - EVENT_RING_SIZE;   // overrun
+                }
+                for(n = 0; n < EVENT_READ_BATCH && done + n < max && *pos != events_head; n++) {
+                        batch[n] = events[*pos & (EVENT_RING_SIZE - 1)];
+                        (*pos)++;
+                }
+                spin_unlock_irqrestore(&events_lock, flags);
+
+                if(n == 0) {
+                        break;
+                }
+                if(copy_to_user(buf + done * sizeof(struct rbutton_event), batch, n * sizeof(struct rbutton_event))) {
+                        return done ? done * sizeof(struct rbutton_event) : -EFAULT;
+                }
+                done += n;
+        }
+
+        return done * sizeof(struct rbutton_event);
+}
+
+static __poll_t events_poll(struct file *f, poll_table *wait) {
+        poll_wait(f, &events_wq, wait);
+
+        return events_pending(f->private_data) ? (EPOLLIN | EPOLLRDNORM) : 0;
+}
+
+static const struct file_operations events_fops = {
+        .owner = THIS_MODULE,
+        .open = events_open,
+        .release = events_release,
+        .read = events_read,
+        .poll = events_poll,
 };
 
-static void set_red_led(bool state) {
-        if(gpio_direction_output(GPIO_RLED_PIN_N, state) < 0) {
-               printk(KERN_ERR "Error setting %d to the red LED\n", state);
+static struct miscdevice events_dev = {
+        .minor = MISC_DYNAMIC_MINOR,
+        .name = RBUTTON_DEV_NAME,
+        .fops = &events_fops,
+        .mode = 0400,
+};
+
+// -- LED patterns -- //
+
+struct rb_step {
+        u16 ms;
+        bool on;
+};
+
+struct rb_pattern {
+        const char *name;
+        const struct rb_step *steps;
+        unsigned int nr_steps;
+        unsigned int repeat;            // passes before the LED goes off, 0: forever
+};
+
+#define RB_PATTERN(_name, _steps, _repeat) \
+        { .name = _name, .steps = _steps, .nr_steps = ARRAY_SIZE(_steps), .repeat = _repeat }
+
+#define STEP_ON(ms)             { ms, true }
+#define STEP_OFF(ms)            { ms, false }
+#define STEP_BLINK(ms)          STEP_ON(ms), STEP_OFF(ms)
+#define STEP_CODE               STEP_BLINK(150)
+
+static const struct rb_step steps_blink[] = { STEP_BLINK(500) };
+static const struct rb_step steps_heartbeat[] = { STEP_ON(70), STEP_OFF(140), STEP_ON(70), STEP_OFF(720) };
+// Faster and faster until the reboot, REBOOT_DELAY in total
+static const struct rb_step steps_countdown[] = {
+        STEP_BLINK(250), STEP_BLINK(250),
+        STEP_BLINK(125), STEP_BLINK(125),
+        STEP_BLINK(62), STEP_BLINK(63), STEP_BLINK(62), STEP_BLINK(63),
+};
+static const struct rb_step steps_disabled[] = { STEP_ON(2000) };
+// Error N: N short blinks and a pause
+static const struct rb_step steps_error1[] = { STEP_CODE, STEP_OFF(1000) };
+static const struct rb_step steps_error2[] = { STEP_CODE, STEP_CODE, STEP_OFF(1000) };
+static const struct rb_step steps_error3[] = { STEP_CODE, STEP_CODE, STEP_CODE, STEP_OFF(1000) };
+
+enum {
+        PAT_BLINK,
+        PAT_HEARTBEAT,
+        PAT_COUNTDOWN,
+        PAT_DISABLED,
+        PAT_ERROR1,
+        PAT_ERROR2,
+        PAT_ERROR3,
+        NR_PATTERNS
+};
+
+static const struct rb_pattern rb_patterns[NR_PATTERNS] = {
+        [PAT_BLINK]     = RB_PATTERN("blink", steps_blink, 0),
+        [PAT_HEARTBEAT] = RB_PATTERN("heartbeat", steps_heartbeat, 0),
+        [PAT_COUNTDOWN] = RB_PATTERN("countdown", steps_countdown, 1),
+        [PAT_DISABLED]  = RB_PATTERN("disabled", steps_disabled, 1),
+        [PAT_ERROR1]    = RB_PATTERN("error1", steps_error1, 0),
+        [PAT_ERROR2]    = RB_PATTERN("error2", steps_error2, 0),
+        [PAT_ERROR3]    = RB_PATTERN("error3", steps_error3, 0),
+};
+
+static DEFINE_SPINLOCK(led_lock);
+static struct hrtimer led_timer;        // soft: runs in softirq context
+
+static void led_set_locked(struct rb_led *l, bool state) {
+        l->on = state;
+        gpiod_set_value(l->gpiod, state);
+}
+
+/**
+ *  Moves the LED to its next step. A finite pattern that has run all its
+ *  passes is stopped, the LED is left off and its 'done' is returned.
+ */
+static void (*led_advance(struct rb_led *l))(void) {
+        const struct rb_pattern *p = l->pattern;
+        const struct rb_step *step;
+        void (*done)(void);
+
+        if(l->step == p->nr_steps) {
+                l->step = 0;
+                if(p->repeat && ++l->pass >= p->repeat) {
+                        done = l->done;
+                        l->pattern = NULL;
+                        l->done = NULL;
+                        led_set_locked(l, false);
+                        return done;
+                }
         }
+
+        step = &p->steps[l->step++];
+        led_set_locked(l, step->on);
+        // From the previous deadline, so a late timer doesn't stretch the pattern
+        l->deadline = ktime_add_ms(l->deadline, step->ms);
+
+        return NULL;
 }
 
-static void set_green_led(bool state) {
-        if(gpio_direction_output(GPIO_GLED_PIN_N, state) < 0) {
-               printk(KERN_ERR "Error setting %d to the green LED\n", state);
+static enum hrtimer_restart led_timer_fn(struct hrtimer *timer) {
+        void (*done[RB_MAX_LEDS])(void);
+        ktime_t now = hrtimer_cb_get_time(timer), next = KTIME_MAX;
+        unsigned int i, nr_done = 0;
+        struct rb_led *l;
+
+        spin_lock(&led_lock);
+        for(i = 0; i < rb_nr_leds; i++) {
+                l = &rb_leds[i];
+                if(l->pattern && ktime_compare(l->deadline, now) <= 0) {
+                        if((done[nr_done] = led_advance(l)) != NULL) {
+                                nr_done++;
+                        }
+                }
+                if(l->pattern && ktime_before(l->deadline, next)) {
+                        next = l->deadline;
+                }
+        }
+        /*
+         * Re-armed under led_lock, like in led_pattern_start(), so a pattern
+         * started meanwhile is in 'next' and never has its timer moved later.
+         * Idle until the next led_pattern_start() if there is nothing to do.
+         */
+        if(next != KTIME_MAX) {
+                hrtimer_start(timer, next, HRTIMER_MODE_ABS_SOFT);
         }
+        spin_unlock(&led_lock);
+
+        for(i = 0; i < nr_done; i++) {
+                done[i]();
+        }
+
+        return HRTIMER_NORESTART;
 }
 
-static void rb_disable_red_led(struct work_struct *work) {
-        struct delayed_work *dw;
+/**
+ *  Runs 'p' on the LED, replacing what it was doing; NULL turns it off.
+ *  'done' is called from the timer (softirq) when a finite pattern ends, when
+ *  it is replaced, or right away if the LED doesn't exist. Never allocates
+ *  nor sleeps.
+ */
+static void led_pattern_start(int led, const struct rb_pattern *p, void (*done)(void)) {
+        void (*replaced)(void);
+        struct rb_led *l;
+        unsigned long flags;
 
-        dw = container_of(work, struct delayed_work, work);
+        if(led >= rb_nr_leds) {
+                if(done) {
+                        done();
+                }
+                return;
+        }
+        l = &rb_leds[led];
+
+        spin_lock_irqsave(&led_lock, flags);
+        replaced = l->done;
+        l->pattern = p;
+        l->done = done;
+        l->step = l->pass = 0;
+        l->deadline = ktime_get();
+        if(p == NULL) {
+                led_set_locked(l, false);
+        }
+        else {
+                // The first step is taken by the timer
+                hrtimer_start(&led_timer, 0, HRTIMER_MODE_REL_SOFT);
+        }
+        spin_unlock_irqrestore(&led_lock, flags);
+
+        if(replaced) {
+                replaced();
+        }
+}
 
-        // Disable red LED
-        set_red_led(false);
+// Toggles the LED, which stops its pattern if it had one
+static void led_toggle(int led) {
+        struct rb_led *l = &rb_leds[led];
+        void (*replaced)(void);
+        unsigned long flags;
 
-        kfree(dw);
+        spin_lock_irqsave(&led_lock, flags);
+        replaced = l->done;
+        l->pattern = NULL;
+        l->done = NULL;
+        led_set_locked(l, !l->on);
+        spin_unlock_irqrestore(&led_lock, flags);
 
-        // Set the ws as free
-        atomic_dec(&ws_in_use);
+        if(replaced) {
+                replaced();
+        }
 }
 
-static void rb_perform_reboot(struct work_struct *work) {
-        struct delayed_work *dw;
+// Everything off, and the timer idle
+static void leds_stop(void) {
+        int i;
+
+        for(i = 0; i < rb_nr_leds; i++) {
+                if(READ_ONCE(rb_leds[i].pattern) || READ_ONCE(rb_leds[i].on)) {
+                        led_pattern_start(i, NULL, NULL);
+                }
+        }
+        hrtimer_cancel(&led_timer);
+}
 
-        dw = container_of(work, struct delayed_work, work);
+// Reboot disabled: the red LED has been on long enough
+static void rb_disabled_done(void) {
+        // Set the ws as free
+        atomic_set(&ws_in_use, 0);
+}
 
+static void rb_perform_reboot(struct work_struct *work) {
         // Disable green LED
-        set_green_led(false);
+        led_pattern_start(LED_GREEN, NULL, NULL);
+
+        if(dry_run) {
+                printk(KERN_INFO "'Reboot button': dry run, not rebooting\n");
+                atomic_set(&ws_in_use, 0);
+                return;
+        }
 
         //kernel_restart(NULL);
         orderly_reboot();
 
-        kfree(dw);              // Well, actually this is never reached
-        atomic_dec(&ws_in_use); // Neither decrementing the 'ws_in_use'
+        // 'ws_in_use' stays set: nothing else to do until the reboot
 }
 
-static void process_context_function(struct work_struct *work) {
-        struct delayed_work *dw;
+// Preallocated: a press never allocates
+static DECLARE_DELAYED_WORK(reboot_work, rb_perform_reboot);
+
+static void account_latency(u64 since) {
+        u64 delta = ktime_get_ns() - since;
+        unsigned int bucket = delta ? ilog2(delta) : 0;
+
+        if(bucket >= LAT_HIST_BUCKETS) {
+                bucket = LAT_HIST_BUCKETS - 1;
+        }
+        atomic64_inc(&lat_hist[bucket]);
+}
+
+// -- Actions -- //
+
+static u16 button_index(struct rb_button *b) {
+        return b - rb_buttons;
+}
+
+static void rb_act_reboot(struct rb_button *b) {
+        bool enabled = READ_ONCE(reboot_flag);
+
+        // One action at a time
+        if(atomic_cmpxchg(&ws_in_use, 0, 1) != 0) {
+                b->busy++;
+                event_emit(b->press_ns, RBUTTON_EV_BUSY, button_index(b));
+                return;
+        }
 
-        dw = kmalloc(sizeof(*dw), GFP_KERNEL);
+        event_emit(b->press_ns, enabled ? RBUTTON_EV_REBOOT : RBUTTON_EV_DISABLED, button_index(b));
 
-        if(reboot_flag) {
+        if(enabled) {
                 printk(KERN_EMERG "'Reboot button' pressed. Rebooting the system!!\n");
-                // Enable green LED
-                set_green_led(true);
+                // Green LED counts down to the reboot
+                led_pattern_start(LED_GREEN, &rb_patterns[PAT_COUNTDOWN], NULL);
 
-                INIT_DELAYED_WORK(dw, rb_perform_reboot);
+                schedule_delayed_work(&reboot_work, REBOOT_DELAY);
         }
         else {
-                // Enable red LED
-                set_red_led(true);
+                // Red LED for a while, then the button is free again
+                led_pattern_start(LED_RED, &rb_patterns[PAT_DISABLED], rb_disabled_done);
+        }
+}
+
+static void rb_act_event(struct rb_button *b) {
+        event_emit(b->press_ns, RBUTTON_EV_USER, button_index(b));
+}
+
+static void rb_act_led(struct rb_button *b) {
+        led_toggle(b->led);
+        event_emit(b->press_ns, RBUTTON_EV_LED, button_index(b));
+}
 
-                INIT_DELAYED_WORK(dw, rb_disable_red_led);
+// Dispatch table, indexed by rb_button->action
+static const struct {
+        const char *name;
+        void (*fn)(struct rb_button *b);
+} rb_actions[RB_NR_ACTIONS] = {
+        [RB_ACT_REBOOT] = { "reboot", rb_act_reboot },
+        [RB_ACT_EVENT]  = { "event",  rb_act_event },
+        [RB_ACT_LED]    = { "led",    rb_act_led },
+};
+
+// -- Interruption Handlers -- //
+
+// Hard IRQ: debounce, and wake the thread for real presses
+static irqreturn_t rbutton_handler(int irq, void *dev_id) {
+        struct rb_button *b = dev_id;
+        u64 now = ktime_get_ns();
+
+        if(b->last_press_ns && now - b->last_press_ns < (u64) READ_ONCE(debounce_ms) * NSEC_PER_MSEC) {
+                b->bounces++;
+                return IRQ_HANDLED;
         }
+        b->last_press_ns = now;
+        b->press_ns = now;
 
-        schedule_delayed_work(dw, REBOOT_DELAY);
+        return IRQ_WAKE_THREAD;
 }
 
-// -- Interruption Handler -- //
-static irqreturn_t rbutton_handler(int irq, void *dev_id, struct pt_regs *regs) {
-        //static spinlock_t interrupt_lock = SPIN_LOCK_UNLOCK; // Deprecated
-        static DEFINE_SPINLOCK(interrupt_lock);
+// IRQ thread: what used to be done from the kworker
+static irqreturn_t rbutton_thread(int irq, void *dev_id) {
+        struct rb_button *b = dev_id;
+
+        b->presses++;
+        rb_actions[b->action].fn(b);
+        account_latency(b->press_ns);
+
+        return IRQ_HANDLED;
+}
+
+static int lat_hist_show(struct seq_file *m, void *v) {
+        int i;
+
+        seq_printf(m, "%16s %16s\n", ">= ns", "presses");
+        for(i = 0; i < LAT_HIST_BUCKETS; i++) {
+                s64 count = atomic64_read(&lat_hist[i]);
+
+                if(count) {
+                        seq_printf(m, "%16llu %16lld\n", i ? 1ULL << i : 0ULL, count);
+                }
+        }
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(lat_hist);
+
+static int stats_show(struct seq_file *m, void *v) {
+        const struct rb_button *b;
+        int i;
+
+        seq_printf(m, "%6s %5s %-8s %10s %10s %10s\n", "button", "irq", "action", "presses", "bounces", "busy");
+        for(i = 0; i < rb_nr_buttons; i++) {
+                b = &rb_buttons[i];
+                seq_printf(m, "%6d %5d %-8s %10lu %10lu %10lu\n", i, b->irq, rb_actions[b->action].name,
+                           READ_ONCE(b->presses), READ_ONCE(b->bounces), READ_ONCE(b->busy));
+        }
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+static int leds_show(struct seq_file *m, void *v) {
+        const struct rb_led *l;
         unsigned long flags;
+        const char *name;
+        bool on;
+        int i;
+
+        seq_printf(m, "%3s %5s %3s %s\n", "led", "gpio", "on", "pattern");
+        for(i = 0; i < rb_nr_leds; i++) {
+                l = &rb_leds[i];
+                spin_lock_irqsave(&led_lock, flags);
+                name = l->pattern ? l->pattern->name : "-";
+                on = l->on;
+                spin_unlock_irqrestore(&led_lock, flags);
+                seq_printf(m, "%3d %5d %3d %s\n", i, desc_to_gpio(l->gpiod), on, name);
+        }
+        return 0;
+}
+
+static int leds_open(struct inode *inode, struct file *f) {
+        return single_open(f, leds_show, NULL);
+}
+
+// "<led> <pattern>" or "<led> off"
+static ssize_t leds_write(struct file *f, const char __user *ubuf, size_t len, loff_t *off) {
+        const struct rb_pattern *p = NULL;
+        char buf[32], name[16];
+        int led, i;
+
+        if(len >= sizeof(buf)) {
+                return -EINVAL;
+        }
+        if(copy_from_user(buf, ubuf, len)) {
+                return -EFAULT;
+        }
+        buf[len] = '\0';
 
-        spin_lock_irqsave(&interrupt_lock, flags);
+        if(sscanf(buf, "%d %15s", &led, name) != 2 || led < 0 || led >= rb_nr_leds) {
+                return -EINVAL;
+        }
+        if(strcmp(name, "off")) {
+                for(i = 0; i < NR_PATTERNS && strcmp(name, rb_patterns[i].name); i++);
+                if(i == NR_PATTERNS) {
+                        return -EINVAL;
+                }
+                p = &rb_patterns[i];
+        }
+        led_pattern_start(led, p, NULL);
+
+        return len;
+}
 
-        if(!atomic_read(&ws_in_use)) {
-                // Set the flag
-                atomic_inc(&ws_in_use);
+static const struct file_operations leds_fops = {
+        .owner = THIS_MODULE,
+        .open = leds_open,
+        .read = seq_read,
+        .llseek = seq_lseek,
+        .release = single_release,
+        .write = leds_write,
+};
 
-                spin_unlock_irqrestore(&interrupt_lock, flags);
-                
-                // Initialize the work for the Work Queues
-                INIT_WORK(&ws, process_context_function);
+// -- Setup -- //
 
-                schedule_work(&ws);
+// "reboot", "event" or "ledN"
+static int parse_action(struct rb_button *b, const char *str) {
+        if(str == NULL || sysfs_streq(str, "reboot")) {
+                b->action = RB_ACT_REBOOT;
+        }
+        else if(sysfs_streq(str, "event")) {
+                b->action = RB_ACT_EVENT;
+        }
+        else if(!strncmp(str, "led", 3) && !kstrtoint(str + 3, 10, &b->led)) {
+                b->action = RB_ACT_LED;
         }
         else {
-                spin_unlock_irqrestore(&interrupt_lock, flags);
+                printk(KERN_ERR "Unknown button action '%s'\n", str);
+                return -EINVAL;
         }
 
-        return IRQ_HANDLED;
+        return 0;
 }
 
-static inline int request_gpio_pin(unsigned int gpio, const char *label, bool input_mode) {
-        // Try to allocate the GPIO
-        if(gpio_request(gpio, label)) {
-                printk(KERN_ERR "Error requesting GPIO %d\n", gpio);
-                return -1;
+// Legacy GPIO numbers from the module parameters
+static int setup_from_params(void) {
+        struct gpio_desc *desc;
+        int i, ret;
+
+        for(i = 0; i < nr_buttons_param; i++) {
+                if(gpio_request(buttons[i], GPIO_INT_PIN_D)) {
+                        printk(KERN_ERR "Error requesting GPIO %d\n", buttons[i]);
+                        return -EBUSY;
+                }
+                desc = gpio_to_desc(buttons[i]);
+                rb_buttons[rb_nr_buttons++].gpiod = desc;
+                if(gpiod_direction_input(desc) < 0) {
+                        printk(KERN_ERR "Error setting GPIO %d as INPUT\n", buttons[i]);
+                        return -EIO;
+                }
+                ret = parse_action(&rb_buttons[i], i < nr_actions_param ? button_actions[i] : NULL);
+                if(ret) {
+                        return ret;
+                }
         }
 
-        if(input_mode) {
-                if(gpio_direction_input(gpio) < 0) {
-                        printk(KERN_ERR "Error setting GPIO %d as INPUT\n", gpio);
-                        gpio_free(gpio);
-                        return -1;
+        for(i = 0; i < nr_leds_param; i++) {
+                if(gpio_request(leds[i], GPIO_LED_PIN_D)) {
+                        printk(KERN_ERR "Error requesting GPIO %d\n", leds[i]);
+                        return -EBUSY;
+                }
+                desc = gpio_to_desc(leds[i]);
+                rb_leds[rb_nr_leds++].gpiod = desc;
+                // Disable leds (just in case the GPIO pin is HIGH)
+                if(gpiod_direction_output(desc, 0) < 0) {
+                        printk(KERN_ERR "Error setting GPIO %d as OUTPUT\n", leds[i]);
+                        return -EIO;
                 }
         }
 
         return 0;
 }
 
-// -- Module functions -- //
-static int __init module_entry_point(void){
-        // Request Interruption GPIO
-        if(request_gpio_pin(GPIO_INT_PIN_N, GPIO_INT_PIN_D, true) < 0) {
-                return -1;
+// Descriptors from the device tree node
+static int setup_from_fw(struct device_node *np) {
+        struct fwnode_handle *fwnode = of_fwnode_handle(np);
+        struct gpio_desc *desc;
+        const char *action;
+        int i, n;
+
+        n = of_count_phandle_with_args(np, "button-gpios", "#gpio-cells");
+        for(i = 0; i < min(n, RB_MAX_BUTTONS); i++) {
+                desc = fwnode_gpiod_get_index(fwnode, "button", i, GPIOD_IN, GPIO_INT_PIN_D);
+                if(IS_ERR(desc)) {
+                        printk(KERN_ERR "Error getting button %d from the device tree\n", i);
+                        return PTR_ERR(desc);
+                }
+                rb_buttons[rb_nr_buttons].gpiod = desc;
+                rb_buttons[rb_nr_buttons++].from_fw = true;
+                if(of_property_read_string_index(np, "button-actions", i, &action)) {
+                        action = NULL;
+                }
+                if(parse_action(&rb_buttons[i], action)) {
+                        return -EINVAL;
+                }
         }
 
-        // Try the IRQ Mapping (Interrupt Request Line)
-        if((irq_number = gpio_to_irq(GPIO_INT_PIN_N)) < 0) {
-                printk(KERN_ERR "Error mapping IRQ (GPIO %d)\n", GPIO_INT_PIN_N);
-                gpio_free(GPIO_INT_PIN_N);
-                return -1;
+        n = of_count_phandle_with_args(np, "led-gpios", "#gpio-cells");
+        for(i = 0; i < min(n, RB_MAX_LEDS); i++) {
+                desc = fwnode_gpiod_get_index(fwnode, "led", i, GPIOD_OUT_LOW, GPIO_LED_PIN_D);
+                if(IS_ERR(desc)) {
+                        printk(KERN_ERR "Error getting LED %d from the device tree\n", i);
+                        return PTR_ERR(desc);
+                }
+                rb_leds[rb_nr_leds].gpiod = desc;
+                rb_leds[rb_nr_leds++].from_fw = true;
         }
 
-        printk(KERN_INFO "IRQ for 'Reboot Button' (GPIO %d) mapped into line %d\n", GPIO_INT_PIN_N, irq_number);
+        return 0;
+}
+
+static int setup_irqs(void) {
+        struct rb_button *b;
+        int i, irq;
+
+        for(i = 0; i < rb_nr_buttons; i++) {
+                b = &rb_buttons[i];
+                if(b->action == RB_ACT_LED && (b->led < 0 || b->led >= rb_nr_leds)) {
+                        printk(KERN_ERR "Button %d toggles LED %d, which doesn't exist\n", i, b->led);
+                        return -EINVAL;
+                }
+
+                // Try the IRQ Mapping (Interrupt Request Line)
+                if((irq = gpiod_to_irq(b->gpiod)) < 0) {
+                        printk(KERN_ERR "Error mapping IRQ (button %d)\n", i);
+                        return irq;
+                }
 
-        // Request this IRQ Handler to the Kernel
-        if(request_irq(irq_number, (irq_handler_t) rbutton_handler, IRQF_TRIGGER_FALLING,
-                                                        GPIO_INT_PIN_D, GPIO_INT_DEVICE_D)) {
-                printk(KERN_ERR "Error requesting irq %d to the kernel\n", irq_number);
-                gpio_free(GPIO_INT_PIN_N);
-                return -1;
+                // Request this IRQ Handler to the Kernel: debounce in hard IRQ, the rest in the thread
+                if(request_threaded_irq(irq, rbutton_handler, rbutton_thread,
+                                        IRQF_TRIGGER_FALLING | IRQF_ONESHOT, GPIO_INT_PIN_D, b)) {
+                        printk(KERN_ERR "Error requesting irq %d to the kernel\n", irq);
+                        return -EBUSY;
+                }
+                b->irq = irq;
+
+                printk(KERN_INFO "IRQ for 'Reboot Button' %d (%s) mapped into line %d\n",
+                       i, rb_actions[b->action].name, irq);
         }
 
-        // Add an entry in /proc/
-        proc_entry = proc_create(PROC_RB_FILENAME, 0, NULL, &pfops);
+        return 0;
+}
 
-        // Setup the leds //
+static void release_all(void) {
+        int i;
 
-        // Request Green LED GPIO
-        if(request_gpio_pin(GPIO_GLED_PIN_N, GPIO_GLED_PIN_D, false) < 0) {
-                return -1;
+        // Release the irqs (waits for the IRQ threads)
+        for(i = 0; i < rb_nr_buttons; i++) {
+                if(rb_buttons[i].irq > 0) {
+                        free_irq(rb_buttons[i].irq, &rb_buttons[i]);
+                }
         }
 
-        // Request Red LED GPIO
-        if(request_gpio_pin(GPIO_RLED_PIN_N, GPIO_RLED_PIN_D, false) < 0) {
-                return -1;
+        // Nothing can start a pattern or schedule the reboot anymore
+        leds_stop();
+        cancel_delayed_work_sync(&reboot_work);
+
+        // Free GPIO resources
+        for(i = 0; i < rb_nr_buttons; i++) {
+                if(rb_buttons[i].from_fw) {
+                        gpiod_put(rb_buttons[i].gpiod);
+                }
+                else {
+                        gpio_free(desc_to_gpio(rb_buttons[i].gpiod));
+                }
         }
+        for(i = 0; i < rb_nr_leds; i++) {
+                if(rb_leds[i].from_fw) {
+                        gpiod_put(rb_leds[i].gpiod);
+                }
+                else {
+                        gpio_free(desc_to_gpio(rb_leds[i].gpiod));
+                }
+        }
+        rb_nr_buttons = rb_nr_leds = 0;
+}
 
-        // Disable leds (just in case the GPIO pin is HIGH)
-        set_green_led(false);
-        set_red_led(false);
+// -- Module functions -- //
+static int __init module_entry_point(void){
+        struct device_node *np;
+        int ret, i;
+
+        hrtimer_init(&led_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+        led_timer.function = led_timer_fn;
+
+        np = of_find_compatible_node(NULL, NULL, RB_OF_COMPATIBLE);
+        if(np) {
+                ret = setup_from_fw(np);
+                of_node_put(np);
+        }
+        else {
+                ret = setup_from_params();
+        }
+        if(ret == 0 && rb_nr_buttons == 0) {
+                printk(KERN_ERR "No buttons configured\n");
+                ret = -ENODEV;
+        }
+        // The patterns set the LEDs from the hrtimer
+        for(i = 0; ret == 0 && i < rb_nr_leds; i++) {
+                if(gpiod_cansleep(rb_leds[i].gpiod)) {
+                        printk(KERN_ERR "LED %d is on a GPIO controller that can sleep\n", i);
+                        ret = -EINVAL;
+                }
+        }
+        if(ret == 0) {
+                ret = setup_irqs();
+        }
+        if(ret) {
+                release_all();
+                return ret;
+        }
+
+        // Add an entry in /proc/
+        proc_entry = proc_create(PROC_RB_FILENAME, 0, NULL, &pfops);
+
+        // /sys/kernel/debug/rbutton/{latency_hist,stats,leds}
+        debugfs_dir = debugfs_create_dir("rbutton", NULL);
+        debugfs_create_file("latency_hist", 0444, debugfs_dir, NULL, &lat_hist_fops);
+        debugfs_create_file("stats", 0444, debugfs_dir, NULL, &stats_fops);
+        debugfs_create_file("leds", 0644, debugfs_dir, NULL, &leds_fops);
+
+        // Press records in /dev/rbutton
+        if((ret = misc_register(&events_dev)) < 0) {
+                printk(KERN_ERR "Error registering /dev/%s\n", RBUTTON_DEV_NAME);
+                debugfs_remove_recursive(debugfs_dir);
+                release_all();
+                if(proc_entry) {
+                        remove_proc_entry(PROC_RB_FILENAME, NULL);
+                }
+                return ret;
+        }
 
         return 0;
 }
 
 static void __exit module_exit_point(void) {
-        // Release the irq
-        free_irq(irq_number, GPIO_INT_DEVICE_D);
+        misc_deregister(&events_dev);
+        debugfs_remove_recursive(debugfs_dir);
 
-        // Free GPIO resources
-        gpio_free(GPIO_INT_PIN_N);
-        gpio_free(GPIO_GLED_PIN_N);
-        gpio_free(GPIO_RLED_PIN_N);
+        release_all();
 
         // Free the /proc/ file
         if(proc_entry) {
                 remove_proc_entry(PROC_RB_FILENAME, NULL);
         }
-
-        // Just in case:
-        flush_work(&ws);
 }
 
 module_init(module_entry_point);
 module_exit(module_exit_point);
-
@@ -30,56 +30,608 @@
 #include <linux/init.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/workqueue.h>
+#include <linux/cpumask.h>
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/timer.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/uaccess.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #define AUTHOR "Fernando Vanyo <fernando@fervagar.com>"
-#define DESC   "Simple example of kernel Work Queues (using system kworkers)"
+#define DESC   "Simple example of kernel Work Queues (using a dedicated workqueue)"
 
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR(AUTHOR);
 MODULE_DESCRIPTION(DESC);
 
+/**
+ *  Everything runs on our own workqueue, so the 2 s sleep of the demo and the
+ *  benchmark load never hold up the system kworkers. The flags are picked at
+ *  load time. For a bound workqueue wq_cpus says on which CPUs the work is
+ *  queued; an unbound one is created with WQ_SYSFS and its CPU mask is set in
+ *  /sys/devices/virtual/workqueue/deferred_wq/cpumask.
+ */
+static bool wq_unbound = false;
+module_param(wq_unbound, bool, S_IRUGO);
+MODULE_PARM_DESC(wq_unbound, "Create an unbound workqueue (WQ_UNBOUND | WQ_SYSFS)");
+
+static bool wq_highpri = false;
+module_param(wq_highpri, bool, S_IRUGO);
+MODULE_PARM_DESC(wq_highpri, "WQ_HIGHPRI: run on the high priority worker pools");
+
+static bool wq_cpu_intensive = false;
+module_param(wq_cpu_intensive, bool, S_IRUGO);
+MODULE_PARM_DESC(wq_cpu_intensive, "WQ_CPU_INTENSIVE: don't count towards the pool's concurrency");
+
+static int wq_max_active = 0;
+module_param(wq_max_active, int, S_IRUGO);
+MODULE_PARM_DESC(wq_max_active, "max_active of the workqueue (0: default)");
+
+static char *wq_cpus = NULL;
+module_param(wq_cpus, charp, S_IRUGO);
+MODULE_PARM_DESC(wq_cpus, "CPU list the benchmark queues on, bound workqueue only (default: all online)");
+
+static int bench_items = 10000;
+module_param(bench_items, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(bench_items, "Work items queued per benchmark run");
+
+static int bench_work_us = 0;
+module_param(bench_work_us, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(bench_work_us, "Time each benchmark item takes (us)");
+
+static bool bench_sleep = false;
+module_param(bench_sleep, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(bench_sleep, "Benchmark items sleep bench_work_us instead of spinning");
+
+static int cont_items = 1000;
+module_param(cont_items, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(cont_items, "Concurrent waiting items per continuation benchmark run");
+
+static int cont_wait_ms = 100;
+module_param(cont_wait_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(cont_wait_ms, "How long each continuation benchmark item waits (ms)");
+
+#define BENCH_MAX_ITEMS		(1 << 20)
+#define LAT_HIST_BUCKETS	40	// bucket N: queue-to-start latency in [2^N, 2^(N+1)) ns
+
+struct cont_event;
+
 struct work_cont {
 	struct work_struct real_work;
 	int    arg;
+	u64    queued_ns;		// benchmark only
+
+	// Continuations, see cont_init()
+	int    (*step_fn)(struct work_cont *c_ptr);
+	int    step;			// where step_fn resumes, up to step_fn
+	unsigned long delay;		// CONT_AFTER: jiffies
+	struct cont_event *event;	// CONT_EVENT
+	struct timer_list timer;
+	struct list_head wait;		// on event->waiters
 } work_cont;
 
-static void thread_function(struct work_struct *work);
+/**
+ *  Continuations: instead of sleeping inside the handler, a step function
+ *  returns what it is waiting for and gives its kworker back:
+ *
+ *	return cont_after(c_ptr, 2 * HZ);	// run me again in 2 s
+ *	return cont_wait(c_ptr, &event);	// run me again once the event fires
+ *	return CONT_DONE;
+ *
+ *  and is called again when that happens, with c_ptr->step telling where it
+ *  was. Waiting items cost a timer or a list entry, not a thread.
+ */
+enum cont_action {
+	CONT_DONE,
+	CONT_AFTER,
+	CONT_EVENT,
+};
+
+struct cont_event {
+	spinlock_t lock;
+	struct list_head waiters;
+	bool fired;			// sticky: late waiters resume right away
+};
+
+static struct workqueue_struct *wq;
+static cpumask_var_t queue_mask;	// where the bound benchmark queues its items
+
+static inline int cont_after(struct work_cont *c_ptr, unsigned long delay){
+	c_ptr->delay = delay;
+	return CONT_AFTER;
+}
+
+static inline int cont_wait(struct work_cont *c_ptr, struct cont_event *e){
+	c_ptr->event = e;
+	return CONT_EVENT;
+}
+
+static void cont_event_init(struct cont_event *e){
+	spin_lock_init(&e->lock);
+	INIT_LIST_HEAD(&e->waiters);
+	e->fired = false;
+}
+
+// Resumes every waiter; can be called from any context
+static void cont_event_fire(struct cont_event *e){
+	struct work_cont *c_ptr, *tmp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&e->lock, flags);
+	e->fired = true;
+	list_for_each_entry_safe(c_ptr, tmp, &e->waiters, wait){
+		list_del_init(&c_ptr->wait);
+		queue_work(wq, &c_ptr->real_work);
+	}
+	spin_unlock_irqrestore(&e->lock, flags);
+}
+
+static void cont_timer_function(struct timer_list *t){
+	struct work_cont *c_ptr = from_timer(c_ptr, t, timer);
+
+	queue_work(wq, &c_ptr->real_work);
+}
+
+static void cont_function(struct work_struct *work_arg){
+	struct work_cont *c_ptr = container_of(work_arg, struct work_cont, real_work);
+	struct cont_event *e;
+	unsigned long flags;
+
+	switch (c_ptr->step_fn(c_ptr)){
+	case CONT_AFTER:
+		mod_timer(&c_ptr->timer, jiffies + c_ptr->delay);
+		break;
+	case CONT_EVENT:
+		e = c_ptr->event;
+		spin_lock_irqsave(&e->lock, flags);
+		if (e->fired)
+			queue_work(wq, &c_ptr->real_work);
+		else
+			list_add_tail(&c_ptr->wait, &e->waiters);
+		spin_unlock_irqrestore(&e->lock, flags);
+		break;
+	default:
+		break;
+	}
+}
+
+static void cont_init(struct work_cont *c_ptr, int (*step_fn)(struct work_cont *)){
+	INIT_WORK(&c_ptr->real_work, cont_function);
+	c_ptr->step_fn = step_fn;
+	c_ptr->step = 0;
+	timer_setup(&c_ptr->timer, cont_timer_function, 0);
+	INIT_LIST_HEAD(&c_ptr->wait);
+}
 
 struct work_cont *test_wq;
 
-static void thread_function(struct work_struct *work_arg){
+static int thread_function(struct work_cont *c_ptr){
+	switch (c_ptr->step++){
+	case 0:
+		printk(KERN_INFO "[Deferred work]=> PID: %d; NAME: %s\n", current->pid, current->comm);
+		printk(KERN_INFO "[Deferred work]=> I am going to sleep 2 seconds\n");
+		// Without holding the kworker meanwhile
+		return cont_after(c_ptr, 2 * HZ); //Wait 2 seconds
+	default:
+		printk(KERN_INFO "[Deferred work]=> DONE. BTW the data is: %d\n", c_ptr->arg);
+		return CONT_DONE;
+	}
+}
+
+/**
+ *  Benchmark: queue bench_items work_conts back to back and time how long
+ *  they wait to start and how long until the last one is done. Run it by
+ *  writing to /sys/kernel/debug/deferred_wq/bench (the write returns when
+ *  the run is over), read the numbers back from the same file.
+ */
+struct bench_result {
+	bool valid;
+	int items, work_us;
+	bool sleep;
+	u64 queue_ns;			// time spent queueing
+	u64 total_ns;			// first queued to last done
+	u64 max_ns;
+	u64 hist[LAT_HIST_BUCKETS];
+};
+
+static atomic64_t bench_hist[LAT_HIST_BUCKETS];
+static atomic64_t bench_max_ns;
+static atomic_t bench_left;
+static DECLARE_COMPLETION(bench_done);
+static DEFINE_MUTEX(bench_lock);	// one run at a time, protects result
+static struct bench_result result;
+static struct dentry *debugfs_dir;
+
+static void bench_function(struct work_struct *work_arg){
 	struct work_cont *c_ptr = container_of(work_arg, struct work_cont, real_work);
+	u64 delta = ktime_get_ns() - c_ptr->queued_ns;
+	unsigned int bucket = delta ? ilog2(delta) : 0;
+	s64 max;
 
-	printk(KERN_INFO "[Deferred work]=> PID: %d; NAME: %s\n", current->pid, current->comm);
-	printk(KERN_INFO "[Deferred work]=> I am going to sleep 2 seconds\n");
-	set_current_state(TASK_INTERRUPTIBLE);
-	schedule_timeout(2 * HZ); //Wait 2 seconds
-	
-	printk(KERN_INFO "[Deferred work]=> DONE. BTW the data is: %d\n", c_ptr->arg);
+	if (bucket >= LAT_HIST_BUCKETS)
+		bucket = LAT_HIST_BUCKETS - 1;
+	atomic64_inc(&bench_hist[bucket]);
+	max = atomic64_read(&bench_max_ns);
+	while ((s64)delta > max && !atomic64_try_cmpxchg(&bench_max_ns, &max, delta))
+		;
 
-	return;
+	if (c_ptr->arg > 0){
+		if (bench_sleep)
+			usleep_range(c_ptr->arg, c_ptr->arg + c_ptr->arg / 8 + 1);
+		else
+			udelay(c_ptr->arg);
+	}
+
+	if (atomic_dec_and_test(&bench_left))
+		complete(&bench_done);
+}
+
+// Called with bench_lock held
+static int bench_run(void){
+	int nr = clamp(READ_ONCE(bench_items), 1, BENCH_MAX_ITEMS);
+	int work_us = max(READ_ONCE(bench_work_us), 0);
+	struct work_cont *items;
+	int n, b, cpu = -1;
+	u64 start;
+
+	items = kvcalloc(nr, sizeof(*items), GFP_KERNEL);
+	if (items == NULL)
+		return -ENOMEM;
+
+	for (b = 0; b < LAT_HIST_BUCKETS; b++)
+		atomic64_set(&bench_hist[b], 0);
+	atomic64_set(&bench_max_ns, 0);
+	atomic_set(&bench_left, nr);
+	reinit_completion(&bench_done);
+
+	start = ktime_get_ns();
+	for (n = 0; n < nr; n++){
+		INIT_WORK(&items[n].real_work, bench_function);
+		items[n].arg = work_us;
+		items[n].queued_ns = ktime_get_ns();
+		if (wq_unbound){
+			queue_work(wq, &items[n].real_work);
+		}
+		else{
+			cpu = cpumask_next(cpu, queue_mask);
+			if (cpu >= nr_cpu_ids)
+				cpu = cpumask_first(queue_mask);
+			queue_work_on(cpu, wq, &items[n].real_work);
+		}
+	}
+	result.queue_ns = ktime_get_ns() - start;
+
+	wait_for_completion(&bench_done);
+	result.total_ns = ktime_get_ns() - start;
+	// The last item may still be returning from its handler
+	flush_workqueue(wq);
+
+	result.items = nr;
+	result.work_us = work_us;
+	result.sleep = bench_sleep;
+	result.max_ns = atomic64_read(&bench_max_ns);
+	for (b = 0; b < LAT_HIST_BUCKETS; b++)
+		result.hist[b] = atomic64_read(&bench_hist[b]);
+	result.valid = true;
+
+	kvfree(items);
+	return 0;
+}
+
+static ssize_t bench_write(struct file *f, const char __user *ubuf, size_t len, loff_t *off){
+	int ret;
+
+	if (mutex_lock_interruptible(&bench_lock))
+		return -ERESTARTSYS;
+	ret = bench_run();
+	mutex_unlock(&bench_lock);
+
+	return ret ? ret : len;
 }
 
+// Upper bound of the bucket holding the permille-th latency
+static u64 hist_percentile(unsigned int permille){
+	u64 want = div_u64((u64)result.items * permille + 999, 1000), seen = 0;
+	int b;
+
+	for (b = 0; b < LAT_HIST_BUCKETS; b++){
+		seen += result.hist[b];
+		if (seen >= want && seen > 0)
+			return min_t(u64, 2ULL << b, result.max_ns);
+	}
+	return result.max_ns;
+}
+
+static int bench_show(struct seq_file *m, void *v){
+	mutex_lock(&bench_lock);
+	seq_printf(m, "workqueue: %s%s%s max_active %d\n",
+		   wq_unbound ? "unbound" : "bound", wq_highpri ? " highpri" : "",
+		   wq_cpu_intensive ? " cpu_intensive" : "", wq_max_active);
+	if (!wq_unbound)
+		seq_printf(m, "cpus: %*pbl\n", cpumask_pr_args(queue_mask));
+	if (result.valid){
+		seq_printf(m, "items: %d (%d us each, %s)\n", result.items, result.work_us,
+			   result.sleep ? "sleeping" : "spinning");
+		seq_printf(m, "queueing: %llu ns/item\n", div_u64(result.queue_ns, result.items));
+		seq_printf(m, "throughput: %llu items/s\n",
+			   div64_u64((u64)result.items * NSEC_PER_SEC, max_t(u64, result.total_ns, 1)));
+		seq_printf(m, "start latency ns: p50 <= %llu p90 <= %llu p99 <= %llu max %llu\n",
+			   hist_percentile(500), hist_percentile(900), hist_percentile(990),
+			   result.max_ns);
+	}
+	mutex_unlock(&bench_lock);
+	return 0;
+}
+
+static int bench_open(struct inode *inode, struct file *f){
+	return single_open(f, bench_show, NULL);
+}
+
+static const struct file_operations bench_fops = {
+	.owner = THIS_MODULE,
+	.open = bench_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+	.write = bench_write,
+};
+
+/**
+ *  Continuation benchmark: cont_items items that each wait cont_wait_ms,
+ *  either sleeping in the handler ("block"), through cont_after() ("after")
+ *  or on an event fired by the runner after cont_wait_ms ("event"). Reports
+ *  how long it took for all of them to finish and how many handlers were
+ *  running at once, i.e. how many kworkers the waiting held.
+ *  /sys/kernel/debug/deferred_wq/cont_bench, same usage as bench.
+ */
+enum cont_mode {
+	CONT_MODE_BLOCK,
+	CONT_MODE_AFTER,
+	CONT_MODE_EVENT,
+	CONT_NR_MODES
+};
+
+static const char * const cont_mode_names[CONT_NR_MODES] = {
+	[CONT_MODE_BLOCK]	= "block",
+	[CONT_MODE_AFTER]	= "after",
+	[CONT_MODE_EVENT]	= "event",
+};
+
+struct cont_result {
+	bool valid;
+	int items, wait_ms;
+	u64 total_ns;
+	int peak_running;
+};
+
+static struct cont_result cont_results[CONT_NR_MODES];
+static struct cont_event cont_bench_event;
+static atomic_t cont_running;
+static atomic_t cont_peak;
+
+static void cont_bench_enter(void){
+	int running = atomic_inc_return(&cont_running);
+	int peak = atomic_read(&cont_peak);
+
+	while (running > peak && !atomic_try_cmpxchg(&cont_peak, &peak, running))
+		;
+}
+
+static void cont_bench_exit(bool done){
+	atomic_dec(&cont_running);
+	if (done && atomic_dec_and_test(&bench_left))
+		complete(&bench_done);
+}
+
+static void cont_block_function(struct work_struct *work_arg){
+	struct work_cont *c_ptr = container_of(work_arg, struct work_cont, real_work);
+
+	cont_bench_enter();
+	msleep(c_ptr->arg);
+	cont_bench_exit(true);
+}
+
+static int cont_bench_step(struct work_cont *c_ptr){
+	int ret = CONT_DONE;
+
+	cont_bench_enter();
+	if (c_ptr->step++ == 0){
+		if (c_ptr->event != NULL)
+			ret = cont_wait(c_ptr, c_ptr->event);
+		else
+			ret = cont_after(c_ptr, msecs_to_jiffies(c_ptr->arg));
+	}
+	cont_bench_exit(ret == CONT_DONE);
+
+	return ret;
+}
+
+// Called with bench_lock held
+static int cont_bench_run(enum cont_mode mode){
+	int nr = clamp(READ_ONCE(cont_items), 1, BENCH_MAX_ITEMS);
+	int wait_ms = max(READ_ONCE(cont_wait_ms), 0);
+	struct cont_result *res = &cont_results[mode];
+	struct work_cont *items;
+	u64 start;
+	int n;
+
+	items = kvcalloc(nr, sizeof(*items), GFP_KERNEL);
+	if (items == NULL)
+		return -ENOMEM;
+
+	cont_event_init(&cont_bench_event);
+	atomic_set(&cont_running, 0);
+	atomic_set(&cont_peak, 0);
+	atomic_set(&bench_left, nr);
+	reinit_completion(&bench_done);
+
+	start = ktime_get_ns();
+	for (n = 0; n < nr; n++){
+		if (mode == CONT_MODE_BLOCK){
+			INIT_WORK(&items[n].real_work, cont_block_function);
+		}
+		else{
+			cont_init(&items[n], cont_bench_step);
+			if (mode == CONT_MODE_EVENT)
+				items[n].event = &cont_bench_event;
+		}
+		items[n].arg = wait_ms;
+		queue_work(wq, &items[n].real_work);
+	}
+	if (mode == CONT_MODE_EVENT){
+		msleep(wait_ms);
+		cont_event_fire(&cont_bench_event);
+	}
+
+	wait_for_completion(&bench_done);
+	res->total_ns = ktime_get_ns() - start;
+	// Every item is done, but handlers and timer callbacks may still be returning
+	flush_workqueue(wq);
+	if (mode != CONT_MODE_BLOCK)
+		for (n = 0; n < nr; n++)
+			del_timer_sync(&items[n].timer);
+
+	res->items = nr;
+	res->wait_ms = wait_ms;
+	res->peak_running = atomic_read(&cont_peak);
+	res->valid = true;
+
+	kvfree(items);
+	return 0;
+}
+
+static ssize_t cont_bench_write(struct file *f, const char __user *ubuf, size_t len, loff_t *off){
+	char buf[16];
+	int mode, ret;
+
+	if (len == 0 || len >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, len))
+		return -EFAULT;
+	buf[len] = '\0';
+
+	for (mode = 0; mode < CONT_NR_MODES; mode++)
+		if (sysfs_streq(buf, cont_mode_names[mode]))
+			break;
+	if (mode == CONT_NR_MODES)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&bench_lock))
+		return -ERESTARTSYS;
+	ret = cont_bench_run(mode);
+	mutex_unlock(&bench_lock);
+
+	return ret ? ret : len;
+}
+
+static int cont_bench_show(struct seq_file *m, void *v){
+	const struct cont_result *res;
+	int mode;
+
+	seq_printf(m, "%-6s %8s %8s %12s %8s\n", "mode", "items", "wait_ms", "total_us", "peak");
+	mutex_lock(&bench_lock);
+	for (mode = 0; mode < CONT_NR_MODES; mode++){
+		res = &cont_results[mode];
+		if (res->valid)
+			seq_printf(m, "%-6s %8d %8d %12llu %8d\n", cont_mode_names[mode], res->items,
+				   res->wait_ms, div_u64(res->total_ns, NSEC_PER_USEC), res->peak_running);
+	}
+	mutex_unlock(&bench_lock);
+	return 0;
+}
+
+static int cont_bench_open(struct inode *inode, struct file *f){
+	return single_open(f, cont_bench_show, NULL);
+}
+
+static const struct file_operations cont_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = cont_bench_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+	.write = cont_bench_write,
+};
+
 static int __init entry_point(void) {
+	unsigned int flags = 0;
+	int ret;
+
+	if (wq_unbound)
+		flags |= WQ_UNBOUND | WQ_SYSFS;
+	if (wq_highpri)
+		flags |= WQ_HIGHPRI;
+	if (wq_cpu_intensive)
+		flags |= WQ_CPU_INTENSIVE;
+
+	if (!zalloc_cpumask_var(&queue_mask, GFP_KERNEL))
+		return -ENOMEM;
+	if (wq_cpus != NULL){
+		ret = cpulist_parse(wq_cpus, queue_mask);
+		if (ret)
+			goto err_mask;
+		cpumask_and(queue_mask, queue_mask, cpu_online_mask);
+	}
+	else{
+		cpumask_copy(queue_mask, cpu_online_mask);
+	}
+	if (cpumask_empty(queue_mask)){
+		ret = -EINVAL;
+		goto err_mask;
+	}
+
+	wq = alloc_workqueue("deferred_wq", flags, max(wq_max_active, 0));
+	if (wq == NULL){
+		ret = -ENOMEM;
+		goto err_mask;
+	}
 
 	test_wq = kmalloc(sizeof(*test_wq), GFP_KERNEL);
-	INIT_WORK(&test_wq->real_work, thread_function);
+	if (test_wq == NULL){
+		ret = -ENOMEM;
+		goto err_wq;
+	}
+	cont_init(test_wq, thread_function);
 	test_wq->arg = 31337;
 
-	schedule_work(&test_wq->real_work);
+	queue_work(wq, &test_wq->real_work);
+
+	debugfs_dir = debugfs_create_dir("deferred_wq", NULL);
+	debugfs_create_file("bench", 0600, debugfs_dir, NULL, &bench_fops);
+	debugfs_create_file("cont_bench", 0600, debugfs_dir, NULL, &cont_bench_fops);
 
 	return 0;
+
+err_wq:
+	destroy_workqueue(wq);
+err_mask:
+	free_cpumask_var(queue_mask);
+	return ret;
 }
 
 static void __exit exit_point(void) {
-	//just in case:
+	debugfs_remove_recursive(debugfs_dir);
+
+	//just in case: the first step arms the timer, the second one doesn't
+	flush_work(&test_wq->real_work);
+	del_timer_sync(&test_wq->timer);
 	flush_work(&test_wq->real_work);
 
+	destroy_workqueue(wq);
+	free_cpumask_var(queue_mask);
 	kfree(test_wq);
 	return;
 }
 
 module_init(entry_point);
 module_exit(exit_point);
-
@@ -30,7 +30,22 @@
 #include <linux/init.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/workqueue.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/jiffies.h>
+#include <linux/hrtimer.h>
+#include <linux/sort.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #define AUTHOR "Fernando Vanyo <fernando@fervagar.com>"
 #define DESC   "Simple example of kernel Work Queues (using system kworkers) [DELAYED version]"
@@ -39,8 +54,60 @@ MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR(AUTHOR);
 MODULE_DESCRIPTION(DESC);
 
+/**
+ *  hrtimer backend for delayed work: the delay is kept in ns instead of being
+ *  rounded to jiffies, and timer_slack_us lets the hrtimer code coalesce
+ *  nearby expirations. On expiry the work is queued, or with a direct_fn that
+ *  is called from the timer (softirq context) and nothing is queued.
+ */
+static int timer_slack_us = 50;
+module_param(timer_slack_us, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(timer_slack_us, "Slack of the hrtimer backend (us)");
+
+static bool hr_demo = false;
+module_param(hr_demo, bool, S_IRUGO);
+MODULE_PARM_DESC(hr_demo, "Run the 2 s demo on the hrtimer backend");
+
+struct hr_work {
+	struct hrtimer timer;
+	struct work_struct work;
+	struct workqueue_struct *wq;
+	void (*direct_fn)(struct hr_work *hw);
+};
+
+static enum hrtimer_restart hr_work_timer(struct hrtimer *timer){
+	struct hr_work *hw = container_of(timer, struct hr_work, timer);
+
+	if (hw->direct_fn != NULL)
+		hw->direct_fn(hw);
+	else
+		queue_work(hw->wq, &hw->work);
+
+	return HRTIMER_NORESTART;
+}
+
+static void hr_work_init(struct hr_work *hw, work_func_t fn, void (*direct_fn)(struct hr_work *)){
+	hrtimer_init(&hw->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	hw->timer.function = hr_work_timer;
+	INIT_WORK(&hw->work, fn);
+	hw->direct_fn = direct_fn;
+}
+
+static void hr_queue_work(struct workqueue_struct *wq, struct hr_work *hw, u64 delay_ns){
+	hw->wq = wq;
+	hrtimer_start_range_ns(&hw->timer, ns_to_ktime(delay_ns),
+			       (u64)max(READ_ONCE(timer_slack_us), 0) * NSEC_PER_USEC,
+			       HRTIMER_MODE_REL_SOFT);
+}
+
+static void hr_cancel_work_sync(struct hr_work *hw){
+	hrtimer_cancel(&hw->timer);
+	cancel_work_sync(&hw->work);
+}
+
 struct work_cont {
 	struct delayed_work out_dwork;
+	struct hr_work out_hr;		// hr_demo
 	int    arg;
 } work_cont;
 
@@ -48,6 +115,11 @@ static void thread_function(struct work_struct *work_arg);
 
 struct work_cont *test_wq;
 
+static void demo_function(struct work_cont *c_ptr){
+	printk(KERN_INFO "[Deferred work]=> PID: %d; NAME: %s\n", current->pid, current->comm);
+	printk(KERN_INFO "[Deferred work]=> BTW the data is: %d\n", c_ptr->arg);
+}
+
 static void thread_function(struct work_struct *work_arg){
 	struct delayed_work *dwork;
 	struct work_cont *c_ptr;
@@ -55,27 +127,637 @@ static void thread_function(struct work_struct *work_arg){
 	dwork = container_of(work_arg, struct delayed_work, work);
 	c_ptr = container_of(dwork, struct work_cont, out_dwork);
 
-	printk(KERN_INFO "[Deferred work]=> PID: %d; NAME: %s\n", current->pid, current->comm);
-	printk(KERN_INFO "[Deferred work]=> BTW the data is: %d\n", c_ptr->arg);
+	demo_function(c_ptr);
 
 	return;
 }
 
+static void hr_thread_function(struct work_struct *work_arg){
+	demo_function(container_of(work_arg, struct work_cont, out_hr.work));
+}
+
+/**
+ *  Timer wheel for large numbers of coarse timeouts that keep being re-armed:
+ *  a wheel_timer is just a list node, arming, re-arming and cancelling are
+ *  O(1) list operations, and a single delayed work ticks the wheel every
+ *  wheel_tick_ms (only while some timer is pending), running everything that
+ *  expired in the tick as one batch.
+ *
+ *  Classic cascading layout: level N has WHEEL_SIZE slots of
+ *  WHEEL_SIZE^N ticks each. A timer goes to the lowest level that covers its
+ *  distance, and the slots of level N+1 are spread into level N each time
+ *  level N wraps. Timers further than the last level are clamped to it.
+ *
+ *  Callbacks run in the tick work, without the wheel lock held, and may
+ *  re-arm their timer. wheel_del() doesn't wait for a running callback.
+ */
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	4
+#define WHEEL_MAX_TICKS	((1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+static int wheel_tick_ms = 4;
+module_param(wheel_tick_ms, int, S_IRUGO);
+MODULE_PARM_DESC(wheel_tick_ms, "Timer wheel granularity (ms, rounded up to jiffies)");
+
+struct wheel_timer {
+	struct hlist_node entry;	// hashed while pending
+	unsigned long expires;		// in wheel ticks
+	void (*fn)(struct wheel_timer *t);
+};
+
+static struct hlist_head wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static DEFINE_SPINLOCK(wheel_lock);
+static unsigned long wheel_clk;		// next tick to process
+static unsigned long wheel_base;	// jiffies at tick 0
+static unsigned long wheel_tick_jiffies;
+static unsigned long wheel_pending;
+static bool wheel_ticking;
+static unsigned long wheel_batches;	// tick works that ran callbacks
+static unsigned long wheel_fired;
+
+static void wheel_tick(struct work_struct *work);
+static DECLARE_DELAYED_WORK(wheel_work, wheel_tick);
+
+static unsigned long wheel_now(void){
+	return (jiffies - wheel_base) / wheel_tick_jiffies;
+}
+
+static void wheel_timer_init(struct wheel_timer *t, void (*fn)(struct wheel_timer *)){
+	INIT_HLIST_NODE(&t->entry);
+	t->fn = fn;
+}
+
+// Called with wheel_lock held
+static void wheel_insert(struct wheel_timer *t){
+	long delta = (long)(t->expires - wheel_clk);
+	int level;
+
+	if (delta < 0){
+		// Late: fire on the next tick
+		t->expires = wheel_clk;
+		delta = 0;
+	}
+	else if (delta > WHEEL_MAX_TICKS){
+		t->expires = wheel_clk + WHEEL_MAX_TICKS;
+		delta = WHEEL_MAX_TICKS;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < (1L << (WHEEL_BITS * (level + 1))))
+			break;
+	hlist_add_head(&t->entry, &wheel[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK]);
+}
+
+/**
+ *  Arm or re-arm a timer to fire in delay_ms (at the granularity of the
+ *  wheel, never early). Returns true if it was pending. Any context.
+ */
+static bool wheel_mod(struct wheel_timer *t, unsigned int delay_ms){
+	unsigned long ticks = DIV_ROUND_UP(msecs_to_jiffies(delay_ms), wheel_tick_jiffies);
+	unsigned long flags;
+	bool pending;
+
+	spin_lock_irqsave(&wheel_lock, flags);
+	pending = !hlist_unhashed(&t->entry);
+	if (pending){
+		hlist_del(&t->entry);
+	}
+	else if (wheel_pending++ == 0 && !wheel_ticking){
+		// Idle wheel: empty, so it can jump to the present
+		wheel_clk = wheel_now();
+		wheel_ticking = true;
+		schedule_delayed_work(&wheel_work, wheel_tick_jiffies);
+	}
+	// +1: the current tick is already partly gone
+	t->expires = wheel_now() + max(ticks, 1UL) + 1;
+	wheel_insert(t);
+	spin_unlock_irqrestore(&wheel_lock, flags);
+
+	return pending;
+}
+
+// Cancel a timer, returns true if it was pending. Any context.
+static bool wheel_del(struct wheel_timer *t){
+	unsigned long flags;
+	bool pending;
+
+	spin_lock_irqsave(&wheel_lock, flags);
+	pending = !hlist_unhashed(&t->entry);
+	if (pending){
+		hlist_del_init(&t->entry);
+		wheel_pending--;
+	}
+	spin_unlock_irqrestore(&wheel_lock, flags);
+
+	return pending;
+}
+
+// Called with wheel_lock held: spread a slot of 'level' into the lower levels
+static unsigned int wheel_cascade(int level, unsigned int idx){
+	struct wheel_timer *t;
+	struct hlist_node *tmp;
+	HLIST_HEAD(list);
+
+	hlist_move_list(&wheel[level][idx], &list);
+	hlist_for_each_entry_safe(t, tmp, &list, entry){
+		__hlist_del(&t->entry);
+		wheel_insert(t);
+	}
+	return idx;
+}
+
+#define WHEEL_INDEX(clk, level)	(((clk) >> (WHEEL_BITS * (level))) & WHEEL_MASK)
+
+static void wheel_tick(struct work_struct *work){
+	struct wheel_timer *t;
+	unsigned long now, flags;
+	unsigned int idx;
+	HLIST_HEAD(expired);
+	int level;
+
+	spin_lock_irqsave(&wheel_lock, flags);
+	now = wheel_now();
+	while ((long)(now - wheel_clk) >= 0){
+		idx = wheel_clk & WHEEL_MASK;
+		// Level 0 wrapped: bring the next slot of level 1 down, and so on
+		for (level = 1; idx == 0 && level < WHEEL_LEVELS; level++)
+			idx = wheel_cascade(level, WHEEL_INDEX(wheel_clk, level));
+		idx = wheel_clk & WHEEL_MASK;
+		// Still hashed, so wheel_del() works until the callback is called
+		while (!hlist_empty(&wheel[0][idx])){
+			t = hlist_entry(wheel[0][idx].first, struct wheel_timer, entry);
+			hlist_del(&t->entry);
+			hlist_add_head(&t->entry, &expired);
+		}
+		wheel_clk++;
+	}
+
+	if (!hlist_empty(&expired))
+		wheel_batches++;
+	while (!hlist_empty(&expired)){
+		t = hlist_entry(expired.first, struct wheel_timer, entry);
+		hlist_del_init(&t->entry);
+		wheel_pending--;
+		wheel_fired++;
+		spin_unlock_irqrestore(&wheel_lock, flags);
+		t->fn(t);
+		spin_lock_irqsave(&wheel_lock, flags);
+	}
+
+	if (wheel_pending)
+		schedule_delayed_work(&wheel_work, wheel_tick_jiffies);
+	else
+		wheel_ticking = false;
+	spin_unlock_irqrestore(&wheel_lock, flags);
+}
+
+/**
+ *  Benchmark: wheel_bench_items objects with one timeout each, armed,
+ *  re-armed wheel_bench_rearms times and cancelled, then armed again and left
+ *  to expire after wheel_bench_delay_ms..2*wheel_bench_delay_ms. Either on the
+ *  wheel ("wheel") or with a delayed_work per object and
+ *  schedule_delayed_work()/mod_delayed_work()/cancel_delayed_work() ("dwork").
+ *  Run it by writing the backend to /sys/kernel/debug/delayed_wq/wheel_bench.
+ */
+static int wheel_bench_items = 100000;
+module_param(wheel_bench_items, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(wheel_bench_items, "Timeouts per wheel benchmark run");
+
+static int wheel_bench_rearms = 4;
+module_param(wheel_bench_rearms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(wheel_bench_rearms, "Re-arms of every timeout per wheel benchmark run");
+
+static int wheel_bench_delay_ms = 200;
+module_param(wheel_bench_delay_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(wheel_bench_delay_ms, "Shortest timeout of the expiry phase (ms)");
+
+#define BENCH_MAX_ITEMS		(1 << 22)
+#define BENCH_PARKED_MS		(60 * MSEC_PER_SEC)	// arm/re-arm/cancel phase: never fires
+
+enum wheel_bench_backend {
+	BENCH_WHEEL,
+	BENCH_DWORK,
+	BENCH_NR_BACKENDS
+};
+
+static const char * const bench_backend_names[BENCH_NR_BACKENDS] = {
+	[BENCH_WHEEL]	= "wheel",
+	[BENCH_DWORK]	= "dwork",
+};
+
+struct bench_obj {
+	struct wheel_timer wt;
+	struct delayed_work dw;
+	u64 deadline_ns;
+};
+
+struct wheel_bench_result {
+	bool valid;
+	int items, rearms, delay_ms;
+	u64 arm_ns, rearm_ns, cancel_ns;	// per operation
+	u64 expire_ns;				// start of the expiry phase to last callback
+	u64 max_late_ns;
+	unsigned long batches;			// works that ran the callbacks
+};
+
+static struct wheel_bench_result wheel_results[BENCH_NR_BACKENDS];
+static DEFINE_MUTEX(bench_lock);
+static DECLARE_COMPLETION(bench_done);
+static atomic_t bench_left;
+static atomic64_t bench_max_late;
+static struct dentry *debugfs_dir;
+
+static void bench_fired(struct bench_obj *o){
+	s64 late = ktime_get_ns() - o->deadline_ns;
+	s64 max = atomic64_read(&bench_max_late);
+
+	while (late > max && !atomic64_try_cmpxchg(&bench_max_late, &max, late))
+		;
+	if (atomic_dec_and_test(&bench_left))
+		complete(&bench_done);
+}
+
+static void bench_wheel_fn(struct wheel_timer *t){
+	bench_fired(container_of(t, struct bench_obj, wt));
+}
+
+static void bench_dwork_fn(struct work_struct *work){
+	bench_fired(container_of(to_delayed_work(work), struct bench_obj, dw));
+}
+
+static void bench_arm(enum wheel_bench_backend b, struct bench_obj *o, unsigned int ms){
+	if (b == BENCH_WHEEL)
+		wheel_mod(&o->wt, ms);
+	else
+		mod_delayed_work(system_wq, &o->dw, msecs_to_jiffies(ms));
+}
+
+// Called with bench_lock held
+static int wheel_bench_run(enum wheel_bench_backend b){
+	int nr = clamp(READ_ONCE(wheel_bench_items), 1, BENCH_MAX_ITEMS);
+	int rearms = max(READ_ONCE(wheel_bench_rearms), 0);
+	int delay_ms = max(READ_ONCE(wheel_bench_delay_ms), 1);
+	struct wheel_bench_result *res = &wheel_results[b];
+	unsigned long batches;
+	struct bench_obj *objs;
+	unsigned int ms;
+	int n, r;
+	u64 t0;
+
+	objs = kvcalloc(nr, sizeof(*objs), GFP_KERNEL);
+	if (objs == NULL)
+		return -ENOMEM;
+	for (n = 0; n < nr; n++){
+		wheel_timer_init(&objs[n].wt, bench_wheel_fn);
+		INIT_DELAYED_WORK(&objs[n].dw, bench_dwork_fn);
+	}
+
+	// Arm, re-arm, cancel: nothing fires
+	t0 = ktime_get_ns();
+	for (n = 0; n < nr; n++){
+		if (b == BENCH_WHEEL)
+			wheel_mod(&objs[n].wt, BENCH_PARKED_MS);
+		else
+			schedule_delayed_work(&objs[n].dw, msecs_to_jiffies(BENCH_PARKED_MS));
+	}
+	res->arm_ns = div_u64(ktime_get_ns() - t0, nr);
+
+	t0 = ktime_get_ns();
+	for (r = 0; r < rearms; r++)
+		for (n = 0; n < nr; n++)
+			bench_arm(b, &objs[n], BENCH_PARKED_MS + r + 1);
+	res->rearm_ns = rearms ? div_u64(ktime_get_ns() - t0, (u64)nr * rearms) : 0;
+
+	t0 = ktime_get_ns();
+	for (n = 0; n < nr; n++){
+		if (b == BENCH_WHEEL)
+			wheel_del(&objs[n].wt);
+		else
+			cancel_delayed_work(&objs[n].dw);
+	}
+	res->cancel_ns = div_u64(ktime_get_ns() - t0, nr);
+
+	// Expiry: spread over [delay_ms, 2 * delay_ms)
+	atomic_set(&bench_left, nr);
+	atomic64_set(&bench_max_late, 0);
+	reinit_completion(&bench_done);
+	batches = READ_ONCE(wheel_batches);
+	t0 = ktime_get_ns();
+	for (n = 0; n < nr; n++){
+		ms = delay_ms + (unsigned int)(n * 7919UL % delay_ms);
+		objs[n].deadline_ns = ktime_get_ns() + (u64)ms * NSEC_PER_MSEC;
+		bench_arm(b, &objs[n], ms);
+	}
+	wait_for_completion(&bench_done);
+	res->expire_ns = ktime_get_ns() - t0;
+
+	// The last callbacks may still be returning
+	if (b == BENCH_WHEEL)
+		flush_delayed_work(&wheel_work);
+	else
+		for (n = 0; n < nr; n++)
+			cancel_delayed_work_sync(&objs[n].dw);
+
+	res->batches = (b == BENCH_WHEEL) ? READ_ONCE(wheel_batches) - batches : nr;
+	res->max_late_ns = atomic64_read(&bench_max_late);
+	res->items = nr;
+	res->rearms = rearms;
+	res->delay_ms = delay_ms;
+	res->valid = true;
+
+	kvfree(objs);
+	return 0;
+}
+
+static ssize_t wheel_bench_write(struct file *f, const char __user *ubuf, size_t len, loff_t *off){
+	char buf[16];
+	int b, ret;
+
+	if (len == 0 || len >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, len))
+		return -EFAULT;
+	buf[len] = '\0';
+
+	for (b = 0; b < BENCH_NR_BACKENDS; b++)
+		if (sysfs_streq(buf, bench_backend_names[b]))
+			break;
+	if (b == BENCH_NR_BACKENDS)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&bench_lock))
+		return -ERESTARTSYS;
+	ret = wheel_bench_run(b);
+	mutex_unlock(&bench_lock);
+
+	return ret ? ret : len;
+}
+
+static int wheel_bench_show(struct seq_file *m, void *v){
+	const struct wheel_bench_result *res;
+	int b;
+
+	seq_printf(m, "wheel: tick %lu jiffies, %lu pending, %lu fired in %lu batches\n",
+		   wheel_tick_jiffies, READ_ONCE(wheel_pending), READ_ONCE(wheel_fired),
+		   READ_ONCE(wheel_batches));
+	seq_printf(m, "%-7s %8s %6s %8s %8s %8s %8s %12s %12s %8s\n", "backend", "items",
+		   "rearms", "delay_ms", "arm_ns", "rearm_ns", "cancel_ns", "expire_us",
+		   "max_late_us", "batches");
+	mutex_lock(&bench_lock);
+	for (b = 0; b < BENCH_NR_BACKENDS; b++){
+		res = &wheel_results[b];
+		if (res->valid)
+			seq_printf(m, "%-7s %8d %6d %8d %8llu %8llu %8llu %12llu %12llu %8lu\n",
+				   bench_backend_names[b], res->items, res->rearms, res->delay_ms,
+				   res->arm_ns, res->rearm_ns, res->cancel_ns,
+				   div_u64(res->expire_ns, NSEC_PER_USEC),
+				   div_u64(res->max_late_ns, NSEC_PER_USEC), res->batches);
+	}
+	mutex_unlock(&bench_lock);
+	return 0;
+}
+
+static int wheel_bench_open(struct inode *inode, struct file *f){
+	return single_open(f, wheel_bench_show, NULL);
+}
+
+static const struct file_operations wheel_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = wheel_bench_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+	.write = wheel_bench_write,
+};
+
+/**
+ *  Jitter benchmark: for each of jitter_delays_us, jitter_samples one-shot
+ *  delayed works in a row, measuring how late each one runs. "dwork" is
+ *  schedule_delayed_work(), "hrtimer" the hrtimer backend handing off to the
+ *  workqueue, "direct" the hrtimer backend with a direct_fn.
+ *  /sys/kernel/debug/delayed_wq/jitter_bench, write a backend or "all".
+ */
+#define JITTER_MAX_DELAYS	8
+#define JITTER_MAX_SAMPLES	10000
+
+static int jitter_delays_us[JITTER_MAX_DELAYS] = { 100, 1000, 10000, 100000 };
+static int nr_jitter_delays = 4;
+module_param_array(jitter_delays_us, int, &nr_jitter_delays, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(jitter_delays_us, "Delays measured by the jitter benchmark (us)");
+
+static int jitter_samples = 50;
+module_param(jitter_samples, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(jitter_samples, "Samples per delay in the jitter benchmark");
+
+enum jitter_backend {
+	JITTER_DWORK,
+	JITTER_HRTIMER,
+	JITTER_DIRECT,
+	JITTER_NR_BACKENDS
+};
+
+static const char * const jitter_backend_names[JITTER_NR_BACKENDS] = {
+	[JITTER_DWORK]		= "dwork",
+	[JITTER_HRTIMER]	= "hrtimer",
+	[JITTER_DIRECT]		= "direct",
+};
+
+struct jitter_probe {
+	struct delayed_work dw;
+	struct hr_work hw;
+	u64 deadline_ns;
+	u64 fired_ns;
+	struct completion done;
+};
+
+struct jitter_result {
+	int delay_us, samples, slack_us;
+	s64 p50_ns, p90_ns, p99_ns, max_ns;
+};
+
+static struct jitter_result jitter_results[JITTER_NR_BACKENDS][JITTER_MAX_DELAYS];
+static int jitter_nr_results[JITTER_NR_BACKENDS];
+
+static void jitter_fired(struct jitter_probe *jp){
+	jp->fired_ns = ktime_get_ns();
+	complete(&jp->done);
+}
+
+static void jitter_dwork_fn(struct work_struct *work){
+	jitter_fired(container_of(to_delayed_work(work), struct jitter_probe, dw));
+}
+
+static void jitter_hr_fn(struct work_struct *work){
+	jitter_fired(container_of(work, struct jitter_probe, hw.work));
+}
+
+static void jitter_direct_fn(struct hr_work *hw){
+	jitter_fired(container_of(hw, struct jitter_probe, hw));
+}
+
+static int cmp_s64(const void *a, const void *b){
+	s64 x = *(const s64 *)a, y = *(const s64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Called with bench_lock held
+static int jitter_bench_run(enum jitter_backend b){
+	int samples = clamp(READ_ONCE(jitter_samples), 1, JITTER_MAX_SAMPLES);
+	int nr_delays = min(READ_ONCE(nr_jitter_delays), JITTER_MAX_DELAYS);
+	struct jitter_result *res;
+	struct jitter_probe *jp;
+	s64 *late;
+	int d, n, delay_us;
+
+	// Not on the stack: timers and works there need the _ONSTACK variants
+	jp = kmalloc(sizeof(*jp), GFP_KERNEL);
+	late = kvmalloc_array(samples, sizeof(*late), GFP_KERNEL);
+	if (jp == NULL || late == NULL){
+		kfree(jp);
+		kvfree(late);
+		return -ENOMEM;
+	}
+
+	INIT_DELAYED_WORK(&jp->dw, jitter_dwork_fn);
+	hr_work_init(&jp->hw, jitter_hr_fn, b == JITTER_DIRECT ? jitter_direct_fn : NULL);
+	init_completion(&jp->done);
+
+	for (d = 0; d < nr_delays; d++){
+		delay_us = max(READ_ONCE(jitter_delays_us[d]), 1);
+		for (n = 0; n < samples; n++){
+			reinit_completion(&jp->done);
+			jp->deadline_ns = ktime_get_ns() + (u64)delay_us * NSEC_PER_USEC;
+			if (b == JITTER_DWORK)
+				schedule_delayed_work(&jp->dw, usecs_to_jiffies(delay_us));
+			else
+				hr_queue_work(system_wq, &jp->hw, (u64)delay_us * NSEC_PER_USEC);
+			wait_for_completion(&jp->done);
+			late[n] = jp->fired_ns - jp->deadline_ns;
+		}
+		sort(late, samples, sizeof(*late), cmp_s64, NULL);
+
+		res = &jitter_results[b][d];
+		res->delay_us = delay_us;
+		res->samples = samples;
+		res->slack_us = (b == JITTER_DWORK) ? 0 : READ_ONCE(timer_slack_us);
+		res->p50_ns = late[samples * 50 / 100];
+		res->p90_ns = late[samples * 90 / 100];
+		res->p99_ns = late[samples * 99 / 100];
+		res->max_ns = late[samples - 1];
+	}
+	jitter_nr_results[b] = nr_delays;
+
+	// jitter_fired() may still be returning
+	cancel_delayed_work_sync(&jp->dw);
+	hr_cancel_work_sync(&jp->hw);
+	kfree(jp);
+	kvfree(late);
+	return 0;
+}
+
+static ssize_t jitter_bench_write(struct file *f, const char __user *ubuf, size_t len, loff_t *off){
+	char buf[16];
+	int b, ret = 0;
+	bool all;
+
+	if (len == 0 || len >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, len))
+		return -EFAULT;
+	buf[len] = '\0';
+
+	all = sysfs_streq(buf, "all");
+	for (b = 0; b < JITTER_NR_BACKENDS; b++)
+		if (all || sysfs_streq(buf, jitter_backend_names[b]))
+			break;
+	if (b == JITTER_NR_BACKENDS)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&bench_lock))
+		return -ERESTARTSYS;
+	for (; b < JITTER_NR_BACKENDS && ret == 0; b++){
+		ret = jitter_bench_run(b);
+		if (!all)
+			break;
+	}
+	mutex_unlock(&bench_lock);
+
+	return ret ? ret : len;
+}
+
+static int jitter_bench_show(struct seq_file *m, void *v){
+	const struct jitter_result *res;
+	int b, d;
+
+	seq_printf(m, "%-8s %10s %8s %8s %10s %10s %10s %10s\n", "backend", "delay_us",
+		   "samples", "slack_us", "p50_ns", "p90_ns", "p99_ns", "max_ns");
+	mutex_lock(&bench_lock);
+	for (b = 0; b < JITTER_NR_BACKENDS; b++){
+		for (d = 0; d < jitter_nr_results[b]; d++){
+			res = &jitter_results[b][d];
+			seq_printf(m, "%-8s %10d %8d %8d %10lld %10lld %10lld %10lld\n",
+				   jitter_backend_names[b], res->delay_us, res->samples, res->slack_us,
+				   res->p50_ns, res->p90_ns, res->p99_ns, res->max_ns);
+		}
+	}
+	mutex_unlock(&bench_lock);
+	return 0;
+}
+
+static int jitter_bench_open(struct inode *inode, struct file *f){
+	return single_open(f, jitter_bench_show, NULL);
+}
+
+static const struct file_operations jitter_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = jitter_bench_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+	.write = jitter_bench_write,
+};
+
 static int __init entry_point(void) {
+	int level, idx;
+
+	for (level = 0; level < WHEEL_LEVELS; level++)
+		for (idx = 0; idx < WHEEL_SIZE; idx++)
+			INIT_HLIST_HEAD(&wheel[level][idx]);
+	wheel_tick_jiffies = max(msecs_to_jiffies(max(wheel_tick_ms, 1)), 1UL);
+	wheel_base = jiffies;
 
 	test_wq = kmalloc(sizeof(*test_wq), GFP_KERNEL);
+	if (test_wq == NULL)
+		return -ENOMEM;
 	INIT_DELAYED_WORK(&test_wq->out_dwork, thread_function);
+	hr_work_init(&test_wq->out_hr, hr_thread_function, NULL);
 	test_wq->arg = 31337;
 
 	printk(KERN_INFO "[Entry point] launching the delayed work for 2 seconds\n");
-	schedule_delayed_work(&test_wq->out_dwork, (2 * HZ));
+	if (hr_demo)
+		hr_queue_work(system_wq, &test_wq->out_hr, 2 * NSEC_PER_SEC);
+	else
+		schedule_delayed_work(&test_wq->out_dwork, (2 * HZ));
+
+	debugfs_dir = debugfs_create_dir("delayed_wq", NULL);
+	debugfs_create_file("wheel_bench", 0600, debugfs_dir, NULL, &wheel_bench_fops);
+	debugfs_create_file("jitter_bench", 0600, debugfs_dir, NULL, &jitter_bench_fops);
 
 	return 0;
 }
 
 static void __exit exit_point(void) {
-	//just in case:
-	flush_work(&test_wq->out_dwork.work);
+	debugfs_remove_recursive(debugfs_dir);
+
+	//just in case: flush_work() would not wait for a work whose timer is still pending
+	flush_delayed_work(&test_wq->out_dwork);
+	hr_cancel_work_sync(&test_wq->out_hr);
+
+	// No timers are left once the benchmark is over
+	cancel_delayed_work_sync(&wheel_work);
 
 	kfree(test_wq);
 	return;
@@ -83,4 +765,3 @@ static void __exit exit_point(void) {
 
 module_init(entry_point);
 module_exit(exit_point);
-
@@ -30,6 +30,27 @@
 #include <linux/init.h>
 #include <linux/syscalls.h>
 #include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/sched/task.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/tracepoint.h>
+#include <linux/pid.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <asm/siginfo.h>
 
 #define AUTHOR "Fernando Vanyo <fernando@fervagar.com>"
@@ -39,57 +60,793 @@ MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR(AUTHOR);
 MODULE_DESCRIPTION(DESC);
 
+#define ZOMBIES_HASH_BITS	10
+#define PARENTS_HASH_BITS	8
+#define HUNT_BATCH		32	// zombies handled per zombies_lock hold
+
+static int scan_interval = 0;
+module_param(scan_interval, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(scan_interval, "Seconds between full consistency scans of the process list (0: never)");
+
+static int reap_grace_ms = 5000;
+module_param(reap_grace_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(reap_grace_ms, "How long a parent may leave zombies unreaped before acting, and between actions (ms)");
+
+static bool parent_nudge = true;
+module_param(parent_nudge, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(parent_nudge, "Send SIGCHLD to parents that are not reaping (0: only report them)");
+
+/**
+ *  Zombies are found from events instead of scanning: every exiting thread group
+ *  leader becomes a candidate (sched_process_exit fires just before exit_notify()
+ *  decides between EXIT_ZOMBIE and EXIT_DEAD), the hunter confirms it, and the
+ *  entry goes away when the task is freed after being reaped (sched_process_free).
+ *  A leader that exits before the rest of its group stays EXIT_ZOMBIE while
+ *  the process lives on, and its parent can't reap it yet: such a candidate is
+ *  parked (hashed, off 'candidates') until the last thread of the group exits.
+ */
+struct zombie {
+	struct hlist_node node;
+	struct list_head pending;	// on 'candidates' until confirmed, off it while parked
+	struct task_struct *task;	// valid while hashed: probe_free() unhashes first
+	struct zparent *parent;		// set once confirmed
+	u64 exit_ns;			// when it was seen exiting (or found by a scan)
+	pid_t pid;
+	bool confirmed;
+};
+
+/**
+ *  Killing a zombie does nothing, only its parent can get rid of it. Confirmed
+ *  zombies (whole thread group gone, see zombie_confirm()) are accounted to
+ *  the parent they had at confirmation time, and the
+ *  parents that keep them for longer than reap_grace_ms get one action each
+ *  (a SIGCHLD nudge or a report), instead of one signal per zombie.
+ */
+struct zparent {
+	struct hlist_node node;
+	struct pid *pid;		// thread group of the parent (referenced)
+	unsigned int nr;		// zombies of this parent still around
+	u64 since_ns;			// nr has been != 0 since then
+	u64 acted_ns;			// last nudge / report
+	unsigned long actions;
+};
+
+static DEFINE_HASHTABLE(zombies, ZOMBIES_HASH_BITS);
+static DEFINE_HASHTABLE(parents, PARENTS_HASH_BITS);
+static unsigned int nr_parents;
+static LIST_HEAD(candidates);
+static DEFINE_SPINLOCK(zombies_lock);	// taken from RCU callbacks (probe_free)
+static DECLARE_WAIT_QUEUE_HEAD(hunter_wq);
+
+static struct tracepoint *tp_exit, *tp_free;
+static bool new_candidates;
+
+static unsigned long nr_lost;		// exits we could not track (no memory)
+static unsigned long nr_missed;		// zombies only the full scan found
+
 struct task_struct *task;
+static struct dentry *debugfs_dir;
 
-static int hunt_zombies(void *data){
+// Called with zombies_lock held
+static struct zombie *zombie_find(struct task_struct *p){
+	struct zombie *z;
+
+	hash_for_each_possible(zombies, z, node, p->pid)
+		if (z->task == p)
+			return z;
+
+	return NULL;
+}
+
+// Called with zombies_lock held
+static struct zombie *zombie_add(struct task_struct *p){
+	struct zombie *z = kmalloc(sizeof(*z), GFP_ATOMIC);
+
+	if (z == NULL){
+		nr_lost++;
+		return NULL;
+	}
+	z->task = p;
+	z->parent = NULL;
+	z->exit_ns = ktime_get_ns();
+	z->pid = p->pid;
+	z->confirmed = false;
+	INIT_LIST_HEAD(&z->pending);
+	hash_add(zombies, &z->node, z->pid);
+
+	return z;
+}
+
+// Called with zombies_lock held
+static struct zparent *parent_get(struct task_struct *p){
+	struct zparent *zp;
+	struct pid *pid;
+
+	rcu_read_lock();
+	pid = task_tgid(rcu_dereference(p->real_parent));
+	rcu_read_unlock();
+
+	hash_for_each_possible(parents, zp, node, (unsigned long)pid)
+		if (zp->pid == pid)
+			goto found;
+
+	zp = kmalloc(sizeof(*zp), GFP_ATOMIC);
+	if (zp == NULL)
+		return NULL;
+	zp->pid = get_pid(pid);
+	zp->nr = 0;
+	zp->since_ns = ktime_get_ns();
+	zp->acted_ns = 0;
+	zp->actions = 0;
+	hash_add(parents, &zp->node, (unsigned long)pid);
+	nr_parents++;
+found:
+	zp->nr++;
+	return zp;
+}
+
+// Called with zombies_lock held
+static void parent_put(struct zparent *zp){
+	if (--zp->nr)
+		return;
+	hash_del(&zp->node);
+	nr_parents--;
+	put_pid(zp->pid);
+	kfree(zp);
+}
+
+/**
+ *  Called with zombies_lock held, for an EXIT_ZOMBIE leader whose group still
+ *  has other threads (delay_group_leader()). While the group is alive it is
+ *  taken off the candidates: probe_exit() of the last thread puts it back.
+ *  The group is dead (live is decremented before that probe) when it is only
+ *  waiting for the last threads to be released: it stays, and is looked at
+ *  again on the next tick.
+ */
+static void zombie_park(struct zombie *z){
+	if (atomic_read(&z->task->signal->live))
+		list_del_init(&z->pending);
+}
+
+/**
+ *  Called with zombies_lock held, for an EXIT_ZOMBIE candidate. It only counts
+ *  against its parent once the whole thread group has exited: before that the
+ *  parent can't reap it and nudging it would be pointless. Returns false, with
+ *  the candidate parked, in that case.
+ */
+static bool zombie_confirm(struct zombie *z){
+	if (!thread_group_empty(z->task)){
+		zombie_park(z);
+		return false;
+	}
+	z->confirmed = true;
+	z->parent = parent_get(z->task);
+	return true;
+}
+
+// Called with zombies_lock held
+static void zombie_del(struct zombie *z){
+	if (z->parent != NULL)
+		parent_put(z->parent);
+	hash_del(&z->node);
+	list_del(&z->pending);
+	kfree(z);
+}
+
+static void probe_exit(void *data, struct task_struct *p){
+	struct zombie *z;
+	unsigned long flags;
+
+	// Other threads are released right away, only leaders can become zombies
+	if (!thread_group_leader(p)){
+		// The last one out: a parked leader can become a real zombie now
+		if (atomic_read(&p->signal->live))
+			return;
+		spin_lock_irqsave(&zombies_lock, flags);
+		z = zombie_find(p->group_leader);
+		if (z != NULL && !z->confirmed && list_empty(&z->pending)){
+			list_add_tail(&z->pending, &candidates);
+			WRITE_ONCE(new_candidates, true);
+		}
+		spin_unlock_irqrestore(&zombies_lock, flags);
+
+		wake_up(&hunter_wq);
+		return;
+	}
+
+	spin_lock_irqsave(&zombies_lock, flags);
+	z = zombie_add(p);
+	if (z != NULL)
+		list_add_tail(&z->pending, &candidates);
+	WRITE_ONCE(new_candidates, true);
+	spin_unlock_irqrestore(&zombies_lock, flags);
+
+	wake_up(&hunter_wq);
+}
+
+static void probe_free(void *data, struct task_struct *p){
+	struct zombie *z;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zombies_lock, flags);
+	z = zombie_find(p);
+	if (z != NULL)
+		zombie_del(z);
+	spin_unlock_irqrestore(&zombies_lock, flags);
+}
+
+/**
+ *  Findings go to userspace as binary records through /dev/zombie_events
+ *  instead of printk. Every CPU has a fixed-size ring; records are only
+ *  produced from process context with preemption disabled, so each ring has
+ *  a single producer at a time, and readers are serialized by events_lock.
+ *  When a ring is full new records are dropped and counted. Records of
+ *  different CPUs are not ordered, use the timestamps.
+ */
+struct zombie_event {
+	__u64 time_ns;		// CLOCK_MONOTONIC: exit (ZOMBIE) or since when the parent holds zombies (PARENT)
+	__s32 pid;
+	__s32 ppid;		// ZOMBIE: parent tgid, PARENT: 0
+	__u16 type;		// ZOMBIE_EV_*
+	__u16 flags;		// ZOMBIE_EV_F_*
+	__u32 nr;		// PARENT: zombies held
+	char comm[16];
+};
+
+#define ZOMBIE_EV_ZOMBIE	0	// a zombie was found
+#define ZOMBIE_EV_PARENT	1	// a parent is not reaping its zombies
+
+#define ZOMBIE_EV_F_SCAN	0x1	// found by a full scan, time_ns is when
+#define ZOMBIE_EV_F_NUDGED	0x2	// the parent was sent SIGCHLD
+
+#define ZOMBIE_EVENTS_DEV_NAME	"zombie_events"
+#define EVENT_RING_SIZE		256	// records per CPU, power of 2
+
+struct event_ring {
+	u32 head;			// written by the producer
+	u32 tail;			// written by the reader
+	unsigned long dropped;
+	struct zombie_event ev[EVENT_RING_SIZE];
+};
+
+static struct event_ring __percpu *event_rings;
+static DEFINE_MUTEX(events_lock);
+static DECLARE_WAIT_QUEUE_HEAD(events_wq);
+
+static void event_emit(const struct zombie_event *ev){
+	struct event_ring *r = get_cpu_ptr(event_rings);
+	u32 head = r->head;
+
+	if (head - smp_load_acquire(&r->tail) >= EVENT_RING_SIZE){
+		r->dropped++;
+		put_cpu_ptr(event_rings);
+		return;
+	}
+	r->ev[head & (EVENT_RING_SIZE - 1)] = *ev;
+	smp_store_release(&r->head, head + 1);
+	put_cpu_ptr(event_rings);
+
+	if (wq_has_sleeper(&events_wq))
+		wake_up_interruptible(&events_wq);
+}
+
+static bool events_pending(void){
+	struct event_ring *r;
+	int cpu;
+
+	for_each_possible_cpu(cpu){
+		r = per_cpu_ptr(event_rings, cpu);
+		if (READ_ONCE(r->head) != READ_ONCE(r->tail))
+			return true;
+	}
+	return false;
+}
+
+static unsigned long events_dropped(void){
+	unsigned long n = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		n += READ_ONCE(per_cpu_ptr(event_rings, cpu)->dropped);
+	return n;
+}
+
+static void target_zombie(struct task_struct *p, u64 exit_ns, u16 flags){
+	struct zombie_event ev = {
+		.time_ns = exit_ns,
+		.pid = p->pid,
+		.type = ZOMBIE_EV_ZOMBIE,
+		.flags = flags,
+	};
+
+	rcu_read_lock();
+	ev.ppid = task_tgid_nr(rcu_dereference(p->real_parent));
+	rcu_read_unlock();
+	strscpy(ev.comm, p->comm, sizeof(ev.comm));
+	event_emit(&ev);
+}
+
+/**
+ *  One action per parent that has been sitting on its zombies for too long.
+ */
+static void act_on_parents(void){
+	struct pid *found[HUNT_BATCH];
+	unsigned int nr[HUNT_BATCH];
+	u64 since[HUNT_BATCH];
+	struct zombie_event ev;
+	bool nudge;
+	u64 now, grace = (u64)max(READ_ONCE(reap_grace_ms), 1) * NSEC_PER_MSEC;
 	struct task_struct *p;
-	struct siginfo info;
-	long remaining;
-	int ret = -ESRCH;
+	struct zparent *zp;
+	unsigned long flags;
+	int bkt, i, n;
 
-	while(!kthread_should_stop()){
-		for_each_process(p){
-			if(p->state == TASK_DEAD){
-				printk(KERN_INFO "Zombie Process Targeted => PID: %d; NAME: %s\n", p->pid, p->comm);
-				
-				/**
-				 *  This is only a POC. Actually, sending a SIGKILL to a zombie process
-				 *  is useless... ;)
-				 */
-				if ( (ret = send_sig_info(SIGKILL, &info, p)) == 0){
-					printk(KERN_INFO "Process %d killed :P\n", p->pid);
-				}
+	do {
+		n = 0;
+		now = ktime_get_ns();
+		spin_lock_irqsave(&zombies_lock, flags);
+		hash_for_each(parents, bkt, zp, node){
+			if (now - zp->since_ns < grace || now - zp->acted_ns < grace)
+				continue;
+			zp->acted_ns = now;
+			zp->actions++;
+			found[n] = get_pid(zp->pid);
+			nr[n] = zp->nr;
+			since[n] = zp->since_ns;
+			if (++n == HUNT_BATCH)
+				break;
+		}
+		spin_unlock_irqrestore(&zombies_lock, flags);
+
+		for (i = 0; i < n; i++){
+			nudge = READ_ONCE(parent_nudge);
+			if (nudge)
+				kill_pid(found[i], SIGCHLD, 1);
+
+			memset(&ev, 0, sizeof(ev));
+			ev.time_ns = since[i];
+			ev.pid = pid_nr(found[i]);
+			ev.type = ZOMBIE_EV_PARENT;
+			ev.flags = nudge ? ZOMBIE_EV_F_NUDGED : 0;
+			ev.nr = nr[i];
+			rcu_read_lock();
+			p = pid_task(found[i], PIDTYPE_PID);
+			if (p != NULL)
+				strscpy(ev.comm, p->comm, sizeof(ev.comm));
+			rcu_read_unlock();
+			event_emit(&ev);
+
+			put_pid(found[i]);
+		}
+	} while (n == HUNT_BATCH);
+}
+
+/**
+ *  Confirm the candidates: zombies become tracked, autoreaped tasks are dropped,
+ *  leaders of groups with threads left are parked.
+ *  Returns true if some candidate has not gone through exit_notify() yet.
+ */
+static bool check_candidates(void){
+	struct task_struct *found[HUNT_BATCH];
+	u64 found_ns[HUNT_BATCH];
+	struct task_struct *p;
+	struct zombie *z, *tmp;
+	unsigned long flags;
+	bool pending;
+	int i, n;
+
+	do {
+		n = 0;
+		spin_lock_irqsave(&zombies_lock, flags);
+		WRITE_ONCE(new_candidates, false);
+		list_for_each_entry_safe(z, tmp, &candidates, pending){
+			p = z->task;
+			if (p->exit_state & EXIT_ZOMBIE){
+				if (!zombie_confirm(z))
+					continue;
+				list_del_init(&z->pending);
+				// Pinned, so it can be handled after dropping the lock
+				get_task_struct(p);
+				found_ns[n] = z->exit_ns;
+				found[n++] = p;
+				if (n == HUNT_BATCH)
+					break;
+			}
+			else if (p->exit_state & EXIT_DEAD){
+				zombie_del(z);
 			}
 		}
+		pending = !list_empty(&candidates);
+		spin_unlock_irqrestore(&zombies_lock, flags);
+
+		for (i = 0; i < n; i++){
+			target_zombie(found[i], found_ns[i], 0);
+			put_task_struct(found[i]);
+		}
+	} while (n == HUNT_BATCH);
+
+	return pending;
+}
+
+static int scan_slice_tasks = 256;
+module_param(scan_slice_tasks, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(scan_slice_tasks, "Processes visited per full scan slice");
 
-		set_current_state(TASK_INTERRUPTIBLE);
-		if (kthread_should_stop()){
+static int scan_slice_us = 100;
+module_param(scan_slice_us, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(scan_slice_us, "Time budget of a full scan slice (microseconds)");
+
+/**
+ *  Slow consistency check: walk the whole process list and track any zombie
+ *  the events missed (e.g. exits before the module was loaded). The walk is
+ *  done in slices bounded by scan_slice_tasks / scan_slice_us; between slices
+ *  the RCU read lock is dropped and the cursor is kept pinned, so the time
+ *  spent in one go does not grow with the number of processes.
+ */
+struct scan_pass {
+	struct task_struct *pos;	// next process to visit (pinned), NULL: from the start
+	bool active;
+	bool at_load;
+	u64 start_ns;
+	u64 busy_ns;
+	u64 max_slice_ns;
+	unsigned long tasks;
+	unsigned int slices;
+	unsigned int restarts;
+};
+
+static void scan_task(struct task_struct *p, bool at_load){
+	struct zombie *z;
+	unsigned long flags;
+	u64 exit_ns = 0;
+
+	if (!(p->exit_state & EXIT_ZOMBIE))
+		return;
+
+	spin_lock_irqsave(&zombies_lock, flags);
+	z = zombie_find(p);
+	if (z == NULL){
+		z = zombie_add(p);
+		if (z != NULL){
+			list_add_tail(&z->pending, &candidates);
+			if (zombie_confirm(z)){
+				list_del_init(&z->pending);
+				exit_ns = z->exit_ns;
+				if (!at_load)
+					nr_missed++;
+			}
+			else{
+				// The rest of the group runs: a parked candidate for now
+				WRITE_ONCE(new_candidates, true);
+				z = NULL;
+			}
+		}
+	}
+	else{
+		z = NULL;	// already tracked (or a candidate)
+	}
+	spin_unlock_irqrestore(&zombies_lock, flags);
+
+	if (z != NULL)
+		target_zombie(p, exit_ns, ZOMBIE_EV_F_SCAN);
+}
+
+static void scan_begin(struct scan_pass *s, bool at_load){
+	memset(s, 0, sizeof(*s));
+	s->active = true;
+	s->at_load = at_load;
+	s->start_ns = ktime_get_ns();
+}
+
+/**
+ *  Visit one slice of the process list. Returns true when the pass is over.
+ */
+static bool scan_slice(struct scan_pass *s){
+	u64 t0 = ktime_get_ns(), t;
+	u64 budget = (u64)max(READ_ONCE(scan_slice_us), 1) * NSEC_PER_USEC;
+	int max_tasks = max(READ_ONCE(scan_slice_tasks), 1);
+	struct task_struct *p;
+	int n = 0;
+
+	rcu_read_lock();
+	p = s->pos;
+	if (p == NULL){
+		p = next_task(&init_task);
+	}
+	else if (!pid_alive(p)){
+		// Released while we were away: its list linkage can't be trusted
+		s->restarts++;
+		p = next_task(&init_task);
+	}
+
+	for (; p != &init_task; p = next_task(p)){
+		// ktime_get_ns() is not free, look at the clock every few tasks
+		if (n >= max_tasks || (n % 16 == 15 && ktime_get_ns() - t0 >= budget))
 			break;
+		scan_task(p, s->at_load);
+		n++;
+	}
+
+	if (s->pos != NULL)
+		put_task_struct(s->pos);
+	if (p == &init_task){
+		s->pos = NULL;
+	}
+	else{
+		get_task_struct(p);
+		s->pos = p;
+	}
+	rcu_read_unlock();
+
+	t = ktime_get_ns() - t0;
+	s->busy_ns += t;
+	s->max_slice_ns = max(s->max_slice_ns, t);
+	s->tasks += n;
+	s->slices++;
+
+	if (s->pos != NULL)
+		return false;
+
+	s->active = false;
+	printk(KERN_DEBUG "[zombiehunter] scan: %lu tasks in %u slices (%u restarts), "
+	       "%llu us busy, max slice %llu us, %llu us total\n",
+	       s->tasks, s->slices, s->restarts,
+	       div_u64(s->busy_ns, NSEC_PER_USEC), div_u64(s->max_slice_ns, NSEC_PER_USEC),
+	       div_u64(ktime_get_ns() - s->start_ns, NSEC_PER_USEC));
+	return true;
+}
+
+static void scan_abort(struct scan_pass *s){
+	if (s->pos != NULL)
+		put_task_struct(s->pos);
+	s->pos = NULL;
+	s->active = false;
+}
+
+static void full_scan(bool at_load){
+	struct scan_pass s;
+
+	scan_begin(&s, at_load);
+	while (!scan_slice(&s))
+		cond_resched();
+}
+
+static int hunt_zombies(void *data){
+	struct scan_pass scan = { };
+	unsigned long last_scan = jiffies;
+	long timeout;
+	int interval;
+	bool pending;
+
+	while(!kthread_should_stop()){
+		pending = check_candidates();
+		act_on_parents();
+
+		interval = READ_ONCE(scan_interval);
+		if (!scan.active && interval > 0 && time_after_eq(jiffies, last_scan + interval * HZ))
+			scan_begin(&scan, false);
+
+		// One slice per round: new candidates are not kept waiting by a long pass
+		if (scan.active){
+			if (scan_slice(&scan))
+				last_scan = jiffies;
+			else{
+				cond_resched();
+				continue;
+			}
 		}
-		remaining = schedule_timeout(2 * HZ); //Wait 2 seconds
-		/* as we set the thread as TASK_INTERRUPTIBLE, the routine may return early if a signal \
-		is delivered to the current task. In this case the remaining time in jiffies will \
-		be returned, or 0 if the timer expired in time
-		*/
+
+		// Candidates still in exit_notify(): look again on the next tick
+		if (pending)
+			timeout = 1;
+		else if (interval > 0)
+			timeout = max_t(long, last_scan + interval * HZ - jiffies, 1);
+		else
+			timeout = MAX_SCHEDULE_TIMEOUT;
+		// Parents with zombies: come back when they may be due
+		if (READ_ONCE(nr_parents))
+			timeout = min_t(long, timeout, msecs_to_jiffies(max(READ_ONCE(reap_grace_ms), 1)));
+
+		wait_event_interruptible_timeout(hunter_wq,
+			READ_ONCE(new_candidates) || kthread_should_stop(), timeout);
 	}
+	scan_abort(&scan);
 	
-	printk(KERN_DEBUG "[kernel thread] bye!!\n");	
+	printk(KERN_DEBUG "[kernel thread] bye!! (%lu zombies missed by events, %lu lost)\n",
+	       nr_missed, nr_lost);
 	return 0;
 }
 
+static int parents_show(struct seq_file *m, void *v){
+	u64 now = ktime_get_ns();
+	struct task_struct *p;
+	struct zparent *zp;
+	unsigned long flags;
+	int bkt;
+
+	seq_printf(m, "%8s %8s %10s %8s %s\n", "tgid", "zombies", "age_ms", "actions", "comm");
+	spin_lock_irqsave(&zombies_lock, flags);
+	rcu_read_lock();
+	hash_for_each(parents, bkt, zp, node){
+		p = pid_task(zp->pid, PIDTYPE_PID);
+		seq_printf(m, "%8d %8u %10llu %8lu %s\n", pid_nr(zp->pid), zp->nr,
+			   div_u64(now - zp->since_ns, NSEC_PER_MSEC), zp->actions,
+			   p ? p->comm : "-");
+	}
+	rcu_read_unlock();
+	spin_unlock_irqrestore(&zombies_lock, flags);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(parents);
+
+static int stats_show(struct seq_file *m, void *v){
+	seq_printf(m, "parents: %u\nmissed by events: %lu\nlost: %lu\n",
+		   READ_ONCE(nr_parents), READ_ONCE(nr_missed), READ_ONCE(nr_lost));
+	seq_printf(m, "events dropped: %lu\n", events_dropped());
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+/**
+ *  Hands out whole records only, draining the rings CPU by CPU. Blocks until
+ *  there is something to read unless O_NONBLOCK.
+ */
+static ssize_t events_read(struct file *f, char __user *buf, size_t len, loff_t *off){
+	size_t max = len / sizeof(struct zombie_event), done = 0;
+	struct event_ring *r;
+	u32 head, tail, idx, n, chunk;
+	int cpu, ret = 0;
+
+	if (max == 0)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&events_lock))
+		return -ERESTARTSYS;
+	while (!events_pending()){
+		mutex_unlock(&events_lock);
+		if (f->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(events_wq, events_pending()))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&events_lock))
+			return -ERESTARTSYS;
+	}
+
+	for_each_possible_cpu(cpu){
+		r = per_cpu_ptr(event_rings, cpu);
+		tail = r->tail;
+		head = smp_load_acquire(&r->head);
+		n = min_t(size_t, head - tail, max - done);
+		while (n > 0){
+			idx = tail & (EVENT_RING_SIZE - 1);
+			chunk = min_t(u32, n, EVENT_RING_SIZE - idx);
+			if (copy_to_user(buf + done * sizeof(struct zombie_event), &r->ev[idx],
+					 chunk * sizeof(struct zombie_event))){
+				ret = -EFAULT;
+				goto out;
+			}
+			tail += chunk;
+			done += chunk;
+			n -= chunk;
+			// Slots go back to the producer once copied out
+			smp_store_release(&r->tail, tail);
+		}
+		if (done == max)
+			break;
+	}
+out:
+	mutex_unlock(&events_lock);
+	return done ? done * sizeof(struct zombie_event) : ret;
+}
+
+static __poll_t events_poll(struct file *f, poll_table *wait){
+	poll_wait(f, &events_wq, wait);
+	if (events_pending())
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+static const struct file_operations events_fops = {
+	.owner = THIS_MODULE,
+	.read = events_read,
+	.poll = events_poll,
+};
+
+static struct miscdevice events_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = ZOMBIE_EVENTS_DEV_NAME,
+	.fops = &events_fops,
+	.mode = 0400,
+};
+
+static void find_tracepoints(struct tracepoint *tp, void *priv){
+	if (!strcmp(tp->name, "sched_process_exit"))
+		tp_exit = tp;
+	else if (!strcmp(tp->name, "sched_process_free"))
+		tp_free = tp;
+}
+
+static void zombies_clear(void){
+	struct zombie *z;
+	struct hlist_node *tmp;
+	unsigned long flags;
+	int bkt;
+
+	spin_lock_irqsave(&zombies_lock, flags);
+	hash_for_each_safe(zombies, bkt, tmp, z, node)
+		zombie_del(z);
+	spin_unlock_irqrestore(&zombies_lock, flags);
+}
+
 static int __init entry_point(void) {
+	int ret;
+
+	for_each_kernel_tracepoint(find_tracepoints, NULL);
+	if (tp_exit == NULL || tp_free == NULL){
+		printk(KERN_ERR "sched_process_{exit,free} tracepoints not found\n");
+		return -ENOENT;
+	}
+
+	event_rings = alloc_percpu(struct event_ring);
+	if (event_rings == NULL)
+		return -ENOMEM;
+
+	// Free first: an entry must never outlive its task
+	ret = tracepoint_probe_register(tp_free, probe_free, NULL);
+	if (ret)
+		goto err_rings;
+	ret = tracepoint_probe_register(tp_exit, probe_exit, NULL);
+	if (ret)
+		goto err_free;
+
+	// The zombies that are already there
+	full_scan(true);
+
 	task = kthread_create(&hunt_zombies, NULL, "MyKernelThread");
+	if (IS_ERR(task)){
+		ret = PTR_ERR(task);
+		goto err_exit;
+	}
 	wake_up_process(task);
 
+	ret = misc_register(&events_dev);
+	if (ret < 0){
+		printk(KERN_ERR "Error registering /dev/%s\n", ZOMBIE_EVENTS_DEV_NAME);
+		kthread_stop(task);
+		goto err_exit;
+	}
+
+	debugfs_dir = debugfs_create_dir("zombiehunter", NULL);
+	debugfs_create_file("parents", 0444, debugfs_dir, NULL, &parents_fops);
+	debugfs_create_file("stats", 0444, debugfs_dir, NULL, &stats_fops);
+
 	return 0;
+
+err_exit:
+	tracepoint_probe_unregister(tp_exit, probe_exit, NULL);
+err_free:
+	tracepoint_probe_unregister(tp_free, probe_free, NULL);
+	tracepoint_synchronize_unregister();
+	zombies_clear();
+err_rings:
+	free_percpu(event_rings);
+	return ret;
 }
 
 static void __exit exit_point(void) {
 	printk(KERN_DEBUG "[rmmod] bye!!\n");
+	debugfs_remove_recursive(debugfs_dir);
+	misc_deregister(&events_dev);
 	kthread_stop(task);
+
+	tracepoint_probe_unregister(tp_exit, probe_exit, NULL);
+	tracepoint_probe_unregister(tp_free, probe_free, NULL);
+	tracepoint_synchronize_unregister();
+	zombies_clear();
+	free_percpu(event_rings);
 	return;
 }
 
 module_init(entry_point);
 module_exit(exit_point);
-